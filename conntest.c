@@ -18,11 +18,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
+#include <math.h>
 #ifdef WIN32
 #define SYSLOG(x)
 #define strcasecmp strcmp
@@ -43,15 +45,29 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <syslog.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <pthread.h>
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#endif /* __i386__ || __x86_64__ */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
 #endif
 
 #include "conntest.h"
 #include "ike.h"
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <linux/net_tstamp.h>
+#include "uring.h"
+#endif /* __linux__ */
 
 /* Ethernet header len */
 #define ETHLEN 14
@@ -95,7 +111,11 @@ int e_flood, e_data_flood;
 int e_sleep = 1000;
 int e_speed = 0;
 int e_speed_unit = 0;
-int e_num_pkts = 0;
+int e_burst = 0;
+int e_kpace = 0;
+double e_open_rate = 0;
+char *e_profile_file = NULL;
+struct profile *e_profile = NULL;
 int e_threads;
 int e_proto;
 int e_do_ike = 0;
@@ -103,6 +123,11 @@ int e_ike_attack = 0;
 char *e_ike_identity = NULL;
 int e_ike_group = 2;
 int e_ike_auth = 1;
+int e_do_http = 0;
+int e_rtt = 0;
+int e_connect_rate = -1;
+int e_connect_window = 1000;
+int e_http_depth = 1;
 char *e_header = NULL;
 int e_header_len = 0;
 int e_sock_type = PF_INET;
@@ -121,6 +146,7 @@ int e_quiet = 0;
 int e_hexdump = 0;
 char *e_ifname = NULL;
 unsigned long long e_freq = 0;
+int e_tsc = 0;
 int e_server = 0;
 int e_server_mode = 0;
 char *e_htdocs = ".";
@@ -130,6 +156,12 @@ int e_csv = 0;
 int e_exit_limit = 0;
 unsigned int e_diag = 0;
 int e_gstats = 0;
+int e_batch = 0;
+int e_gso = 0;
+int e_engine = 0;
+int e_reuseport = 0;
+int e_http_check = 1000;
+char *e_mime_types = NULL;
 
 unsigned char read_buf[65536];
 
@@ -137,12 +169,26 @@ unsigned char read_buf[65536];
 #define SERVER_ECHO 2
 #define SERVER_HTTP 3
 
+#define ENGINE_SYNC 0
+#define ENGINE_URING 1
+
+/* -s rate pacing */
+#define PACE_USER 0		/* Sleep between sends */
+#define PACE_RATE 1		/* SO_MAX_PACING_RATE, kernel paces TCP */
+#define PACE_TXTIME 2		/* SO_TXTIME launch times, fq qdisc paces */
+#define PACE_BURST 10		/* Default burst, msec of traffic */
+#define PACE_LEAD 1		/* Launch times ahead, msec of traffic */
+
 static unsigned char ip4_header[20] = "\x45\x00\x00\x00\x00\x00\x00\x00\xff\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00";
 
-#define MAX_SOCKETS 20000
-#define MAX_CONNS 4000
+#define MAX_CONNS 20000
 
-#define CONN_HASH_SIZE 512
+#define CONN_HASH_SIZE 512	/* Initial size, grows with load */
+#define RECV_BATCH 64
+#define RECV_CTRL_LEN 64
+#define SPIN_NSEC 50000		/* Spin the end of a sleep */
+#define FREQ_CALIBRATE 250	/* TSC calibration time, msec */
+#define SEND_CTRL_LEN 32
 #define EXPIRE_UDP 4000
 
 #define CLIENT 0
@@ -161,10 +207,140 @@ double g_p_recv_bytes;
 double g_p_send_bytes;
 unsigned int g_p_time;
 unsigned long long g_conns;
+unsigned long long g_hash_key;
+unsigned long long g_profile_start;
+
+#define CACHE_LINE 64
+
+/* Hierarchical timer wheel, one tick is the -n interval.  Each level has
+   64 slots, and a timer is on the level whose slot size covers its
+   delay.  When the lower level wraps around, the timers of the next
+   level's current slot are moved down. */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct timer {
+  struct timer *next;
+  struct timer *prev;
+  unsigned long long expires;
+};
+
+struct timer_wheel {
+  unsigned long long now;
+  struct timer slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/* Pool of fixed size objects.  Freed objects are kept on a free list for
+   reuse.  Objects are allocated <slab> at a time, or one at a time when
+   <slab> is 1, and then at most <max_free> are kept. */
+struct pool {
+  void *free;
+  size_t size;
+  int slab;
+  int num_free;
+  int max_free;
+};
+
+/* Connection buffer size classes */
+#define BUF_CLASSES 3
+#define BUF_HEADER 16
+static const unsigned int buf_class_size[BUF_CLASSES] = { 2048, 16384, 65536 };
+
+/* HTTP file cache.  Each worker keeps the served files open with their
+   response headers rendered, both without and with keep-alive.  A file
+   is released when it is no longer cached and no response refers to it. */
+#define HTTP_CACHE_SIZE 256	/* Hash table size */
+#define HTTP_CACHE_MAX 1024	/* Max cached files per worker */
+#define HTTP_HEADER_MAX 256
+#define HTTP_MAP_MAX 65536	/* Larger files are sent with sendfile() */
+#define HTTP_PIPELINE 32	/* Max pipelined requests */
+#define HTTP_CLIENT_HDR 4096	/* Max response header in HTTP client */
+
+struct http_file {
+  struct http_file *next;
+  char *path;
+  unsigned long long hash;
+  void *data;
+  int fd;
+  int refs;
+  char cached;
+  off_t size;
+  time_t mtime;
+  ino_t ino;
+  unsigned long long checked;
+  size_t hdr_len[2];
+  char hdr[2][HTTP_HEADER_MAX];
+};
+
+struct http_cache {
+  struct http_file *table[HTTP_CACHE_SIZE];
+  int num;
+};
+
+/* MIME types by file name extension */
+#define MIME_HASH_SIZE 256
+#define MIME_EXT_MAX 16
+#define MIME_TYPE_MAX 96	/* Must fit in HTTP_HEADER_MAX */
+
+struct mime_type {
+  struct mime_type *next;
+  char ext[MIME_EXT_MAX];
+  const char *type;
+};
+
+static const char *mime_builtin[][2] = {
+  { "html", "text/html" },
+  { "htm", "text/html" },
+  { "php", "text/html" },
+  { "css", "text/css" },
+  { "js", "text/javascript" },
+  { "txt", "text/plain" },
+  { "xml", "text/xml" },
+  { "json", "application/json" },
+  { "jpg", "image/jpeg" },
+  { "jpeg", "image/jpeg" },
+  { "gif", "image/gif" },
+  { "png", "image/png" },
+  { "svg", "image/svg+xml" },
+  { "ico", "image/x-icon" },
+};
+
+static struct mime_type *mime_table[MIME_HASH_SIZE];
+
+/* HTTP client connection */
+struct http_conn {
+  unsigned long long sent[HTTP_PIPELINE];  /* Send times of requests */
+  int head;
+  int inflight;
+  int wlen;			/* Request bytes not written yet */
+  char pollout;
+  long long left;		/* Requests left to send, < 0 no limit */
+  unsigned long long body;	/* Response body bytes left */
+  char *hdr;			/* Partial response header */
+  int hdr_len;
+};
+
+/* Echo round trip time state of TCP connection.  The echoed stream is
+   split to -d sized packets, each starting with the diagnostics sequence
+   and the send time. */
+#define RTT_HEADER 12
+
+struct echo_rtt {
+  unsigned int off;		/* Offset in the current packet */
+  unsigned char hdr[RTT_HEADER];
+};
+
+/* Queued HTTP response of pipelined requests */
+
+struct http_resp {
+  struct http_file *file;	/* NULL if there is no file body */
+  const char *hdr;
+  size_t hdr_len;
+};
 
 struct socket_conn {
-  struct socket_conn *next;
-  struct socket_conn *prev;
+  unsigned int hash;
   int hprint;
   unsigned long long recv_pkts;
   unsigned long long send_pkts;
@@ -178,17 +354,24 @@ struct socket_conn {
   unsigned int p_time;
   unsigned int diag;
   c_sockaddr addr;
-  char *ip;
-  int port;
+
+  /* UDP expiry and report timer */
+  struct timer timer;
+  struct socket *sock;
+  unsigned long long start;
+  unsigned long long active;
+  unsigned long long t_pkts;
+
   unsigned char *buf;
   unsigned char *bufp;
   size_t buf_off;
   size_t buf_len;
-  unsigned char *page;
-  size_t page_size;
-  char *method;
-  char *uri;
-  char keepalive;
+  struct http_resp *resp;
+  int resp_head;
+  int resp_num;
+  size_t resp_off;
+  char pollout;
+  char http_close;
 };
 
 struct socket {
@@ -203,7 +386,8 @@ struct socket {
   c_sockaddr udp_src;
   struct socket_conn *conn;
   struct socket_conn **conns;
-  int num_conns;
+  unsigned int conns_size;
+  unsigned int num_conns;
 };
 
 struct sockets {
@@ -213,7 +397,196 @@ struct sockets {
   struct socket *sockets;
 #endif /* MAX_SOCKETS */
   int num_sockets;
+
+  /* Free slots for accepted TCP connections */
+  int *free_slots;
+  int num_free;
+  pthread_mutex_t free_lock;
+};
+
+/* Batch of packets sent with one system call */
+struct send_batch {
+#ifdef __linux__
+  struct mmsghdr *msgs;
+#else
+  void *msgs;
+#endif /* __linux__ */
+  struct iovec *iov;
+  unsigned char *buf;
+  unsigned char *ctrl;		/* SO_TXTIME control data */
+  unsigned int len;
+  int num;
+  int segs;
+  int filled;
+  struct uring_engine *uring;
+};
+
+/* Datagrams received, and echoed back, with one system call */
+struct recv_batch {
+#ifdef __linux__
+  struct mmsghdr *msgs;
+  struct mmsghdr *out;
+#endif /* __linux__ */
+  struct iovec *iov;
+  c_sockaddr *addr;
+  struct socket_conn **conns;
+  unsigned int *gso;
+  unsigned char *ctrl;
+  unsigned char *buf;
+  int num;
+};
+
+/* Latency histogram.  Values below 2^HIST_SUB_BITS have their own
+   buckets, larger ones are split to 2^HIST_SUB_BITS buckets per power of
+   two, which keeps the error of any value within ~3%. */
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+  unsigned long long count;
+  unsigned long long max;
+  unsigned long long buckets[HIST_BUCKETS];
+};
+
+/* Non-blocking connect phase */
+struct connector {
+  int epfd;
+  int pending;			/* Connects in progress */
+  int done;
+  int failed;
+  unsigned long long start;
+  unsigned long long next;	/* Time of next connect by -X rate */
+  unsigned long long *started;	/* Connect start time per socket */
+  struct hist hist;
+};
+
+/* Token bucket for the -s rate.  Tokens are bits, refilled from the
+   monotonic clock at the worker's share of the rate. */
+struct pacer {
+  double rate;			/* Bits per nanosecond, 0 no limit */
+  double burst;			/* Bucket size, bits */
+  double lead;			/* Bits sent ahead with launch times */
+  double tokens;
+  double frame;			/* Bits per packet on the wire */
+  unsigned long long last;	/* Time of last refill, ns */
+  int mode;
+  double launch;		/* SO_TXTIME of next packet, ns */
+  double gap;			/* Time between packets, ns */
+  double share;			/* Share of the total rate */
+  double cost;			/* Tokens for the next packet */
+  int poisson;			/* Exponential inter-arrivals */
+  unsigned long long rnd;
+  unsigned long long until;	/* Next -y profile rate change, ns */
+  int open;			/* Open loop, -w */
+  double next;			/* Intended time of next send, ns */
+  unsigned long long intended;	/* Intended time of this send, ns */
+};
+
+/* Traffic profile (-y) shapes */
+#define PROFILE_STEP 0		/* Constant rate */
+#define PROFILE_RAMP 1		/* Linear from rate to rate2 */
+#define PROFILE_BURST 2		/* Rate for on time, nothing for off time */
+#define PROFILE_POISSON 3	/* Mean rate, exponential inter-arrivals */
+#define PROFILE_RAMP_NS 1000000	/* Ramp rate update interval */
+
+struct profile_seg {
+  int shape;
+  unsigned long long len;	/* Duration, ns */
+  double rate;			/* Bits per second */
+  double rate2;
+  unsigned long long on;	/* Burst on and off times, ns */
+  unsigned long long off;
+};
+
+struct profile {
+  struct profile_seg *seg;
+  int num;
+  int loop;			/* Repeat when it ends */
+  unsigned long long total;	/* Duration, ns */
+};
+
+/* Traffic statistics of one worker.  Each worker updates only its own
+   statistics, and the reporter sums them up to the g_ counters. */
+struct stats {
+  unsigned long long recv_pkts;
+  unsigned long long send_pkts;
+  double recv_bytes;
+  double send_bytes;
+  long long conns;
+  unsigned long long reqs;
+  unsigned long long errors;
+} __attribute__((aligned(CACHE_LINE)));
+
+/* Worker thread.  Each worker handles its own share of the sockets. */
+struct worker {
+  struct stats stats;
+  pthread_t thread;
+  int id;
+  struct sockets *s;
+  int offset;
+  int num;
+  int time;
+  unsigned long long last_active;
+
+  /* Server */
+  int epfd;
+  struct recv_batch *rbatch;
+  struct timer_wheel *wheel;
+  struct pool conn_pool;
+  struct pool buf_pool[BUF_CLASSES];
+  struct http_cache http_cache;
+
+  /* Client */
+  unsigned char *data;
+  int len;
+  struct pacer pacer;
+  unsigned int diag;
+  int lip_s;
+  struct send_batch *batch;
+  struct hist *hist;
+  struct http_conn *http;
+  struct echo_rtt *rtt;
+  int done;
+} __attribute__((aligned(CACHE_LINE)));
+
+#ifdef __linux__
+#define URING_SEND 1
+#define URING_RECV 2
+
+#define URING_BUSY_SEND 0x01
+#define URING_BUSY_RECV 0x02
+
+/* Sends in flight per engine, in addition to one receive per socket */
+#define URING_DEPTH 256
+
+/* io_uring request in flight */
+struct uring_req {
+  struct uring_req *next;
+  int op;
+  int index;
+  int fixed;
+  unsigned char *buf;
+  unsigned int off;
+  unsigned int len;
+  struct msghdr msg;
+  struct iovec iov;
+};
+
+/* io_uring send engine */
+struct uring_engine {
+  struct uring *ring;
+  struct uring_req *reqs;
+  struct uring_req *free;
+  struct uring_req *free_recv;
+  unsigned char *busy;		/* Per worker socket, from offset */
+  unsigned char *slots;
+  unsigned int len;
+  int offset;
+  int fixed;
+  int inflight;
+  int error;
 };
+#endif /* __linux__ */
 
 #define PUT32(d, n)							\
 do {									\
@@ -247,6 +620,14 @@ do {									\
   sizeof((so).sin6) : sizeof((so).sin))
 
 void server(void);
+void send_batch_free(struct send_batch *b);
+void http_client(struct sockets *s);
+int client_report(struct worker *workers, int num, const char *what,
+		  int msec);
+int profile_report(struct worker *workers, int num, int len);
+static inline const char *http_crlf(const char *p, const char *end);
+static void freq_init(void);
+int mime_init(const char *filename);
 
 void sockets_alloc(struct sockets *s, unsigned int num)
 {
@@ -257,6 +638,116 @@ void sockets_alloc(struct sockets *s, unsigned int num)
 #endif /* !MAX_SOCKETS */
 }
 
+/* Puts all unused socket slots to the free slot stack, lowest slot on
+   top. */
+
+void sockets_free_init(struct sockets *s)
+{
+  int i;
+
+  s->free_slots = calloc(s->num_sockets, sizeof(*s->free_slots));
+  if (!s->free_slots)
+    exit(1);
+  pthread_mutex_init(&s->free_lock, NULL);
+
+  for (i = s->num_sockets - 1; i >= 0; i--)
+    if (!s->sockets[i].sock)
+      s->free_slots[s->num_free++] = i;
+}
+
+/* Returns free socket slot, or -1 if all slots are in use */
+
+int sockets_get_slot(struct sockets *s)
+{
+  int slot = -1;
+
+  pthread_mutex_lock(&s->free_lock);
+  if (s->num_free)
+    slot = s->free_slots[--s->num_free];
+  pthread_mutex_unlock(&s->free_lock);
+
+  return slot;
+}
+
+void sockets_put_slot(struct sockets *s, int slot)
+{
+  pthread_mutex_lock(&s->free_lock);
+  s->free_slots[s->num_free++] = slot;
+  pthread_mutex_unlock(&s->free_lock);
+}
+
+void pool_init(struct pool *p, size_t size, int slab, int max_free)
+{
+  memset(p, 0, sizeof(*p));
+  p->size = (size + 15) & ~15;
+  p->slab = slab;
+  p->max_free = max_free;
+}
+
+void *pool_get(struct pool *p)
+{
+  unsigned char *slab;
+  void *obj;
+  int i;
+
+  if (!p->free) {
+    slab = malloc(p->size * p->slab);
+    if (!slab)
+      return NULL;
+    for (i = 0; i < p->slab; i++) {
+      *(void **)(slab + (i * p->size)) = p->free;
+      p->free = slab + (i * p->size);
+    }
+    p->num_free += p->slab;
+  }
+
+  obj = p->free;
+  p->free = *(void **)obj;
+  p->num_free--;
+
+  return obj;
+}
+
+void pool_put(struct pool *p, void *obj)
+{
+  if (p->slab == 1 && p->num_free >= p->max_free) {
+    free(obj);
+    return;
+  }
+
+  *(void **)obj = p->free;
+  p->free = obj;
+  p->num_free++;
+}
+
+/* Returns buffer of at least <len> bytes from the smallest fitting size
+   class, or NULL. */
+
+unsigned char *buf_get(struct pool *pools, unsigned int len)
+{
+  unsigned char *buf;
+  int i;
+
+  for (i = 0; i < BUF_CLASSES; i++)
+    if (len <= buf_class_size[i])
+      break;
+  if (i == BUF_CLASSES)
+    return NULL;
+
+  buf = pool_get(&pools[i]);
+  if (!buf)
+    return NULL;
+  *buf = i;
+
+  return buf + BUF_HEADER;
+}
+
+void buf_put(struct pool *pools, unsigned char *buf)
+{
+  buf -= BUF_HEADER;
+  pool_put(&pools[*buf], buf);
+}
+
 static inline
 unsigned long long rdtsc(void)
 {
@@ -297,17 +788,123 @@ unsigned long long rdtsc(void)
 #endif /* __GNUC__ || __ICC */
 }
 
-static inline void bsleep(unsigned int t)
+static inline unsigned long long mono_ns(void)
 {
-  unsigned long long end = rdtsc();
+  struct timespec ts;
 
-  if (!end) {
-    usleep(t);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns the time in e_freq ticks.  The TSC is used only when it is
+   invariant, otherwise the ticks are nanoseconds from the vDSO
+   clock_gettime(). */
+
+static inline unsigned long long ticks(void)
+{
+  return e_tsc ? rdtsc() : mono_ns();
+}
+
+/* Sleeps until <deadline>, in mono_ns() time.  The bulk of the wait is
+   slept and only the last SPIN_NSEC are spun to wake up on time. */
+
+static void sleep_until(unsigned long long deadline)
+{
+  struct timespec ts;
+
+  if (deadline > mono_ns() + SPIN_NSEC) {
+    deadline -= SPIN_NSEC;
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	   EINTR) ;
+    deadline += SPIN_NSEC;
+  }
+
+  while (mono_ns() < deadline) ;
+}
+
+static inline void hist_add(struct hist *h, unsigned long long v)
+{
+  int shift, i = v;
+
+  if (v >= 1 << HIST_SUB_BITS) {
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    i = ((shift + 1) << HIST_SUB_BITS) +
+      (int)(v >> shift) - (1 << HIST_SUB_BITS);
+  }
+
+  h->buckets[i]++;
+  h->count++;
+  if (v > h->max)
+    h->max = v;
+}
+
+/* Returns the largest value of bucket <i> */
+
+static unsigned long long hist_bucket_value(int i)
+{
+  int shift;
+
+  if (i < 1 << HIST_SUB_BITS)
+    return i;
+
+  shift = (i >> HIST_SUB_BITS) - 1;
+  return ((((unsigned long long)1 << HIST_SUB_BITS) +
+	   (i & ((1 << HIST_SUB_BITS) - 1))) << shift) +
+    ((unsigned long long)1 << shift) - 1;
+}
+
+/* Adds <src> to <dst>, or subtracts when <sub> is set.  After
+   subtracting the max is the largest value left in the histogram. */
+
+static void hist_merge(struct hist *dst, const struct hist *src, int sub)
+{
+  int i;
+
+  if (sub) {
+    dst->count -= src->count;
+    for (i = 0; i < HIST_BUCKETS; i++)
+      dst->buckets[i] -= src->buckets[i];
+    for (i = HIST_BUCKETS - 1; i >= 0 && !dst->buckets[i]; i--) ;
+    if (i < 0)
+      dst->max = 0;
+    else if (hist_bucket_value(i) < dst->max)
+      dst->max = hist_bucket_value(i);
     return;
   }
 
-  end = rdtsc() + ((unsigned long long)t * (e_freq / 1000));
-  while (rdtsc() < end) ;
+  /* Count from the buckets, the source may be updated meanwhile */
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    dst->buckets[i] += src->buckets[i];
+    dst->count += src->buckets[i];
+  }
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+/* Returns the value at quantile <q>, 0.0 - 1.0 */
+
+static unsigned long long hist_value(const struct hist *h, double q)
+{
+  unsigned long long n, sum = 0;
+  int i;
+
+  if (!h->count)
+    return 0;
+
+  n = q * h->count + 0.5;
+  if (n < 1)
+    n = 1;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    sum += h->buckets[i];
+    if (sum >= n)
+      break;
+  }
+  if (i == HIST_BUCKETS || hist_bucket_value(i) > h->max)
+    return h->max;
+
+  return hist_bucket_value(i);
 }
 
 void hexdump(const unsigned char *data, size_t data_len,
@@ -414,8 +1011,7 @@ unsigned short do_csum(unsigned char *d, int len)
   return ~(unsigned short)csum;
 }
 
-void thread_data_send(struct sockets *s, int offset, int num,
-                      int loop, void *data, int datalen, int flood);
+void *thread_data_send(void *context);
 
 int is_ip6(const char *addr)
 {
@@ -653,6 +1249,13 @@ int create_server(int port, char *local_ip, int index,
 
   set_sockopt(sock, SOL_SOCKET, SO_REUSEADDR, 1);
 
+#ifdef SO_REUSEPORT
+  /* Each thread binds its own listener to the same address, and the
+     kernel spreads the incoming flows across them */
+  if (e_reuseport)
+    set_sockopt(sock, SOL_SOCKET, SO_REUSEPORT, 1);
+#endif /* SO_REUSEPORT */
+
 #ifdef SO_BINDTODEVICE
   /* Bind to specified interface */
   if (e_ifname)
@@ -690,6 +1293,16 @@ int create_server(int port, char *local_ip, int index,
 #endif /* SO_RCVBUFFORCE */
   }
 
+#if defined(UDP_GRO)
+  /* Receive coalesced datagrams */
+  if (e_gso && e_proto == SOCK_DGRAM) {
+    if (set_sockopt(sock, SOL_UDP, UDP_GRO, 1) < 0) {
+      fprintf(stderr, "conntest: UDP GRO not supported, -U disabled\n");
+      e_gso = 0;
+    }
+  }
+#endif /* UDP_GRO */
+
   /* TCP socket listens */
   if (e_proto == SOCK_STREAM) {
     if (listen(sock, 16384) < 0) {
@@ -718,6 +1331,27 @@ int create_server(int port, char *local_ip, int index,
   return sock;
 }
 
+/* Hands the -s pacing of the UDP or raw socket to the kernel with -k.
+   Packets are sent with launch times for the fq qdisc.  If the kernel
+   can't do it the rate is paced in user space.  TCP sockets are paced
+   with kernel_pace_rate() once the connections are up. */
+
+static void kernel_pace(int sock)
+{
+#if defined(SO_TXTIME)
+  struct sock_txtime txtime;
+
+  memset(&txtime, 0, sizeof(txtime));
+  txtime.clockid = CLOCK_MONOTONIC;
+  if (set_sockopt2(sock, SOL_SOCKET, SO_TXTIME, &txtime,
+		   sizeof(txtime)) == 0)
+    return;
+#endif /* SO_TXTIME */
+
+  fprintf(stderr, "conntest: Kernel pacing not supported, -k is ignored\n");
+  e_kpace = 0;
+}
+
 /* Creates a new TCP/IP or UDP/IP connection. Returns the newly created
    socket or -1 on error. */
 
@@ -896,19 +1530,24 @@ int create_connection(int port, char *dhost, int index,
   }
 #endif
 
-  /* connect to the host */
+  /* connect to the host, with -X the connect completes later */
   if (e_proto == SOCK_STREAM) {
-    if (!e_quiet)
+    if (!e_quiet && e_connect_rate < 0)
       fprintf(stderr, "Connecting to port %d of host %s (%s).", port,
 	      dhost ? dhost : "N/A", dhost ? dst : "N/A");
 
+    if (e_connect_rate >= 0)
+      fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
     i = connect(sock, &desthost.sa, SIZEOF_SOCKADDR(desthost));
+    if (i < 0 && e_connect_rate >= 0 && errno == EINPROGRESS)
+      i = 0;
     if (i < 0) {
-      fprintf(stderr, "\nconnect(): %s\n", strerror(errno));
+      if (e_connect_rate < 0)
+	fprintf(stderr, "\nconnect(): %s\n", strerror(errno));
       shutdown(sock, 2);
       close(sock);
     } else {
-      if (!e_quiet)
+      if (!e_quiet && e_connect_rate < 0)
 	fprintf(stderr, " Done.\n");
       set_sockopt(sock, IPPROTO_TCP, TCP_NODELAY, 1);
       sockets->sockets[index].sock = sock;
@@ -938,6 +1577,18 @@ int create_connection(int port, char *dhost, int index,
     if (set_sockopt(sock, SOL_SOCKET, SO_SNDBUF, 1000000) < 0)
       set_sockopt(sock, SOL_SOCKET, SO_SNDBUF, 65535);
 #endif /* SO_SNDBUF */
+    /* Kernel segments our super-datagrams to -d sized packets */
+    if (e_gso && e_proto == SOCK_DGRAM) {
+#if defined(UDP_SEGMENT)
+      if (set_sockopt(sock, SOL_UDP, UDP_SEGMENT, e_data_len) < 0) {
+	fprintf(stderr, "conntest: UDP GSO not supported, -U is ignored\n");
+	e_gso = 0;
+      }
+#else
+      fprintf(stderr, "conntest: UDP GSO not supported, -U is ignored\n");
+      e_gso = 0;
+#endif /* UDP_SEGMENT */
+    }
 #if defined(SO_SNDBUFFORCE)
     if (set_sockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, 1000000) < 0)
       set_sockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, 65535);
@@ -945,6 +1596,8 @@ int create_connection(int port, char *dhost, int index,
 #if defined(SO_SNDTIMEO)
       set_sockopt2(sock, SOL_SOCKET, SO_SNDTIMEO, (void *)&timeo, sizeof(timeo));
 #endif /* SO_SNDTIMEO */
+    if (e_kpace)
+      kernel_pace(sock);
     return sock;
   }
 
@@ -961,20 +1614,140 @@ int close_connection(int sock)
   return 0;
 }
 
-/* Sends data to the host. */
+static void connect_init(struct connector *cc, int num)
+{
+  memset(cc, 0, sizeof(*cc));
+  cc->epfd = epoll_create(num);
+  cc->started = calloc(num, sizeof(*cc->started));
+  if (cc->epfd < 0 || !cc->started) {
+    fprintf(stderr, "conntest: %s\n", strerror(errno));
+    exit(1);
+  }
+  if (!e_freq)
+    freq_init();
+  cc->start = cc->next = ticks();
+}
 
-int send_data(struct sockets *s, int index, void *data, unsigned int len)
+/* Completes connects that are ready, waiting at most <timeout> ms */
+
+static void connect_reap(struct connector *cc, struct sockets *s,
+			 int timeout)
 {
-  int ret, i, off = 0;
-  int sock = s->sockets[index].sock;
+  struct epoll_event events[64];
+  int i, n, index, sock, err;
+  socklen_t len;
+
+  n = epoll_wait(cc->epfd, events, 64, timeout);
+  for (i = 0; i < n; i++) {
+    index = events[i].data.u32;
+    sock = s->sockets[index].sock;
+    epoll_ctl(cc->epfd, EPOLL_CTL_DEL, sock, &events[i]);
+    cc->pending--;
+
+    err = 0;
+    len = sizeof(err);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+      err = errno;
+    if (err) {
+      SYSLOG((LOG_ERR, "connect(): %s\n", strerror(err)));
+      close_connection(sock);
+      s->sockets[index].sock = -1;
+      cc->failed++;
+      continue;
+    }
+
+    hist_add(&cc->hist, (unsigned long long)
+	     ((double)(ticks() - cc->started[index]) * 1000000.0 / e_freq));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+    cc->done++;
+  }
+}
+
+/* Waits until the -X rate and -Z window allow next connect */
+
+static void connect_pace(struct connector *cc, struct sockets *s)
+{
+  unsigned long long now;
+
+  while (cc->pending >= e_connect_window)
+    connect_reap(cc, s, 10);
+
+  if (!e_connect_rate)
+    return;
+
+  while ((now = ticks()) < cc->next)
+    connect_reap(cc, s, (cc->next - now) / e_freq);
+
+  /* Don't burst to catch up after a stall */
+  if (cc->next + e_freq * 1000 / e_connect_rate < now)
+    cc->next = now;
+  cc->next += e_freq * 1000 / e_connect_rate;
+}
+
+/* Adds connect in progress on socket <index>, <ret> is the return value
+   of create_connection() */
+
+static void connect_add(struct connector *cc, struct sockets *s, int index,
+			int ret)
+{
+  struct epoll_event event;
+
+  if (ret < 0) {
+    s->sockets[index].sock = -1;
+    cc->failed++;
+    return;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLOUT;
+  event.data.u32 = index;
+  if (epoll_ctl(cc->epfd, EPOLL_CTL_ADD, s->sockets[index].sock, &event)) {
+    fprintf(stderr, "conntest: epoll_ctl: %s\n", strerror(errno));
+    exit(1);
+  }
+  cc->started[index] = ticks();
+  cc->pending++;
+}
+
+/* Waits for the rest of the connects and drops the failed connections
+   from the socket table.  Returns the number of connections. */
+
+static int connect_finish(struct connector *cc, struct sockets *s, int num)
+{
+  double sec;
+  int i, n;
+
+  while (cc->pending)
+    connect_reap(cc, s, 100);
+  sec = (double)(ticks() - cc->start) / e_freq / 1000.0;
+
+  for (i = n = 0; i < num; i++)
+    if (s->sockets[i].sock >= 0)
+      s->sockets[n++] = s->sockets[i];
+
+  if (!e_quiet)
+    fprintf(stderr, "Connected %d of %d in %.2f s (%.0f conn/s), %d failed, "
+	    "usec p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+	    cc->done, num, sec, cc->done / (sec > 0 ? sec : 1), cc->failed,
+	    hist_value(&cc->hist, 0.50) / 1000.0,
+	    hist_value(&cc->hist, 0.99) / 1000.0,
+	    hist_value(&cc->hist, 0.999) / 1000.0, cc->hist.max / 1000.0);
+
+  close(cc->epfd);
+  free(cc->started);
+  return n;
+}
+
+/* Prepares the data to be sent to the host: makes it unique, adds
+   diagnostics sequence and raw IPv4 headers, if requested. */
+
+static void send_data_prepare(struct worker *w, int index, void *data,
+			      unsigned int len)
+{
+  struct sockets *s = w->s;
+  int i, off = 0;
   unsigned char *iph = s->sockets[index].iph;
-  c_sockaddr *udp = &s->sockets[index].udp_dest;
-  c_sockaddr *src = &s->sockets[index].udp_src;
-  unsigned char *d = data, tmp[40];
-  struct msghdr msg;
-  struct cmsghdr *cm;
-  struct in6_pktinfo *pkt;
-  struct iovec iov;
+  unsigned char *d = data;
 
   /* If requested, make data unique */
   if (e_unique && !e_diag)
@@ -982,35 +1755,19 @@ int send_data(struct sockets *s, int index, void *data, unsigned int len)
       d[i] ^= d[i + 1] ^ ((d[i] + 0x9d2c5681UL) * 1812433253UL) >> 11;
 
   if (e_diag) {
-    PUT32(d, e_diag);
-    e_diag++;
+    PUT32(d, w->diag);
+    w->diag++;
   }
 
-  if (e_want_ip6) {
-    /* IPv6 */
-
-    /* For raw sockets set up msghdr and use sendmsg() */
-    if (e_proto == SOCK_RAW) {
-      iov.iov_base = data;
-      iov.iov_len = len;
-
-      memset(&msg, 0, sizeof(msg));
-      msg.msg_name = (void *)&udp->sa;
-      msg.msg_namelen = SIZEOF_SOCKADDR(*udp);
-      msg.msg_iov = &iov;
-      msg.msg_iovlen = 1;
-
-      msg.msg_control = cm = (struct cmsghdr *)tmp;
-      cm->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
-      msg.msg_controllen = cm->cmsg_len;
-      cm->cmsg_level = IPPROTO_IPV6;
-      cm->cmsg_type = IPV6_PKTINFO;
+  /* Send time for echo round trip, read back only by us.  In open loop
+     it is the intended send time. */
+  if (e_rtt) {
+    unsigned long long now = w->pacer.open ? w->pacer.intended : mono_ns();
+    memcpy(d + 4, &now, sizeof(now));
+  }
+  w->stats.send_pkts++;
 
-      pkt = (struct in6_pktinfo *)CMSG_DATA(cm);
-      pkt->ipi6_ifindex = src->sin6.sin6_scope_id;
-      memcpy(&pkt->ipi6_addr, &src->sin6.sin6_addr, 16);
-    }
-  } else {
+  if (!e_want_ip6) {
     /* IPv4 */
 
     /* If raw sockets and local IP is specified, now copy the IP header */
@@ -1028,14 +1785,14 @@ int send_data(struct sockets *s, int index, void *data, unsigned int len)
 
     /* Randomize source port if requested */
     if (e_random_lport) {
-      d[off] = d[15] ^ (e_time ^ (e_time >> 11));
+      d[off] = d[15] ^ (w->time ^ (w->time >> 11));
       d[off + 1] = d[14] ^ d[13] ^ ((d[12] << 7) & 0x9d2c5680UL);
-      e_time += 2749;
+      w->time += 2749;
     }
 
     /* Randomize source IP if requested */
     if (e_random_ip) {
-      iph[12] = d[12] ^= (e_time ^ (e_time >> 11));
+      iph[12] = d[12] ^= (w->time ^ (w->time >> 11));
       iph[13] = d[13] ^= d[12] ^ ((d[13] << 7) & 0x9d2c5680UL);
       iph[14] = d[14] ^= d[13] ^ ((d[14] << 15) & 0xefc60000UL);
       iph[15] = d[15] ^= d[14] ^ (d[15] >> 18);
@@ -1043,14 +1800,14 @@ int send_data(struct sockets *s, int index, void *data, unsigned int len)
         iph[12] = d[12] = 1;
       if (d[15] == 255)
         iph[15] = d[15] = 1;
-      e_time += 2749;
+      w->time += 2749;
     }
 
     /* Source IP range if requested */
     if (e_lip_start && e_lip_end) {
-      if (e_lip_s > e_lip_e)
-        e_lip_s = atoi(strrchr(e_lip_start, '.') + 1);
-      iph[15] = d[15] = e_lip_s++;
+      if (w->lip_s > e_lip_e)
+        w->lip_s = atoi(strrchr(e_lip_start, '.') + 1);
+      iph[15] = d[15] = w->lip_s++;
     }
   }
 
@@ -1058,6 +1815,82 @@ int send_data(struct sockets *s, int index, void *data, unsigned int len)
     fprintf(stdout, "\n");
     hexdump(data, len, stdout);
   }
+}
+
+#ifdef SO_TXTIME
+/* Adds the SO_TXTIME launch time of the next packet from the worker's
+   pacer to <msg>, after any control data it already has.  The pacer moves
+   on by <num> packets. */
+
+static void send_txtime(struct worker *w, struct msghdr *msg,
+			unsigned char *ctrl, int num)
+{
+  struct pacer *p = &w->pacer;
+  unsigned long long t = p->launch;
+  struct cmsghdr *cm;
+
+  if (!msg->msg_control)
+    msg->msg_control = ctrl;
+  cm = (struct cmsghdr *)((unsigned char *)msg->msg_control +
+			  msg->msg_controllen);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_TXTIME;
+  cm->cmsg_len = CMSG_LEN(sizeof(t));
+  memcpy(CMSG_DATA(cm), &t, sizeof(t));
+  msg->msg_controllen += CMSG_SPACE(sizeof(t));
+
+  p->launch += num * p->gap;
+}
+#endif /* SO_TXTIME */
+
+/* Sends data to the host. */
+
+int send_data(struct worker *w, int index, void *data, unsigned int len)
+{
+  struct sockets *s = w->s;
+  int ret;
+  int sock = s->sockets[index].sock;
+  c_sockaddr *udp = &s->sockets[index].udp_dest;
+  c_sockaddr *src = &s->sockets[index].udp_src;
+  unsigned char tmp[64];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct in6_pktinfo *pkt;
+  struct iovec iov;
+  int use_msg = (e_want_ip6 && e_proto == SOCK_RAW) ||
+    w->pacer.mode == PACE_TXTIME;
+
+  send_data_prepare(w, index, data, len);
+
+  /* For raw IPv6 sockets and launch times set up msghdr and use
+     sendmsg() */
+  if (use_msg) {
+    iov.iov_base = data;
+    iov.iov_len = len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)&udp->sa;
+    msg.msg_namelen = SIZEOF_SOCKADDR(*udp);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+  }
+
+  if (e_want_ip6 && e_proto == SOCK_RAW) {
+    msg.msg_control = cm = (struct cmsghdr *)tmp;
+    cm->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+    msg.msg_controllen = CMSG_SPACE(sizeof(struct in6_pktinfo));
+    cm->cmsg_level = IPPROTO_IPV6;
+    cm->cmsg_type = IPV6_PKTINFO;
+
+    pkt = (struct in6_pktinfo *)CMSG_DATA(cm);
+    pkt->ipi6_ifindex = src->sin6.sin6_scope_id;
+    memcpy(&pkt->ipi6_addr, &src->sin6.sin6_addr, 16);
+  }
+
+#ifdef SO_TXTIME
+  if (w->pacer.mode == PACE_TXTIME)
+    send_txtime(w, &msg, tmp, 1);
+#endif /* SO_TXTIME */
 
 #if 0
   if (e_proto == SOCK_RAW && e_sock_proto == IPPROTO_UDP && !e_header) {
@@ -1089,12 +1922,15 @@ int send_data(struct sockets *s, int index, void *data, unsigned int len)
       return -1;
     }
 
-    /* Read also any incmoing data in non-blocking mode */
-    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
-    while ((read(sock, read_buf, sizeof(read_buf))) > 0) ;
-    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+    /* Read also any incmoing data in non-blocking mode, echoes are
+       read by the sending thread */
+    if (!e_rtt) {
+      fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+      while ((read(sock, read_buf, sizeof(read_buf))) > 0) ;
+      fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+    }
 
-  } else if (e_proto == SOCK_RAW && e_want_ip6) {
+  } else if (use_msg) {
     ret = sendmsg(sock, &msg, 0);
     if (ret < 0) {
       fprintf(stderr, "sendmsg(sock:%d %d): %s (%d) (pid %d)\n", sock, index,
@@ -1113,6 +1949,442 @@ int send_data(struct sockets *s, int index, void *data, unsigned int len)
   return 0;
 }
 
+/* Returns the number of -d sized packets that fit in one UDP GSO
+   super-datagram, or 0 if GSO is not in use. */
+
+static int gso_segments(unsigned int len)
+{
+  int segs;
+
+  if (!e_gso || e_proto != SOCK_DGRAM)
+    return 0;
+
+  segs = (e_want_ip6 ? 65527 : 65507) / len;
+  if (segs > 64)
+    segs = 64;
+
+  return segs;
+}
+
+/* Allocates context for sending batch of <num> packets of <len> bytes
+   with one system call. */
+
+struct send_batch *send_batch_alloc(int num, unsigned int len)
+{
+  struct send_batch *b;
+
+  b = calloc(1, sizeof(*b));
+  if (!b)
+    return NULL;
+
+  b->msgs = calloc(num, sizeof(*b->msgs));
+  b->iov = calloc(num, sizeof(*b->iov));
+  b->buf = malloc(num * len);
+  if (e_kpace)
+    b->ctrl = calloc(num, SEND_CTRL_LEN);
+  if (!b->msgs || !b->iov || !b->buf || (e_kpace && !b->ctrl)) {
+    send_batch_free(b);
+    return NULL;
+  }
+  b->num = num;
+  b->len = len;
+  b->segs = gso_segments(len);
+
+  return b;
+}
+
+#ifdef __linux__
+static void uring_engine_free(struct uring_engine *u);
+#endif /* __linux__ */
+
+void send_batch_free(struct send_batch *b)
+{
+  if (!b)
+    return;
+#ifdef __linux__
+  uring_engine_free(b->uring);
+#endif /* __linux__ */
+  free(b->msgs);
+  free(b->iov);
+  free(b->buf);
+  free(b->ctrl);
+  free(b);
+}
+
+#ifdef __linux__
+/* Creates io_uring send engine for the sockets of the worker.  The payload
+   <data> and the per send payload copies are registered to the ring as
+   fixed buffers. */
+
+static struct uring_engine *uring_engine_create(struct worker *w,
+						void *data, unsigned int len)
+{
+  struct uring_engine *u;
+  struct iovec iov[2];
+  int i, num, sends;
+
+  u = calloc(1, sizeof(*u));
+  if (!u)
+    return NULL;
+
+  u->ring = uring_create(1024);
+  if (!u->ring) {
+    free(u);
+    return NULL;
+  }
+
+  /* One send and one receive per TCP connection, and URING_DEPTH sends
+     per engine for datagrams.  Only the sends have payload slots. */
+  sends = e_proto == SOCK_STREAM ? w->num : URING_DEPTH;
+  num = sends + (e_proto == SOCK_STREAM ? w->num : 0);
+  u->reqs = calloc(num, sizeof(*u->reqs));
+  u->busy = calloc(w->num, sizeof(*u->busy));
+  u->slots = malloc(sends * len);
+  if (!u->reqs || !u->busy || !u->slots) {
+    uring_engine_free(u);
+    return NULL;
+  }
+  u->len = len;
+  u->offset = w->offset;
+
+  for (i = num - 1; i >= sends; i--) {
+    u->reqs[i].next = u->free_recv;
+    u->free_recv = &u->reqs[i];
+  }
+  for (; i >= 0; i--) {
+    u->reqs[i].next = u->free;
+    u->free = &u->reqs[i];
+  }
+
+  iov[0].iov_base = data;
+  iov[0].iov_len = len;
+  iov[1].iov_base = u->slots;
+  iov[1].iov_len = sends * len;
+  u->fixed = !uring_register_buffers(u->ring, iov, 2);
+
+  return u;
+}
+
+static void uring_engine_free(struct uring_engine *u)
+{
+  if (!u)
+    return;
+  uring_free(u->ring);
+  free(u->reqs);
+  free(u->busy);
+  free(u->slots);
+  free(u);
+}
+
+/* Queues the request to the submission queue, submitting the queue first
+   if it is full. */
+
+static int uring_engine_queue(struct uring_engine *u, struct sockets *s,
+			      struct uring_req *req)
+{
+  struct io_uring_sqe *sqe;
+  c_sockaddr *udp = &s->sockets[req->index].udp_dest;
+
+  sqe = uring_get_sqe(u->ring);
+  if (!sqe) {
+    if (uring_submit(u->ring, 0) < 0)
+      return -1;
+    sqe = uring_get_sqe(u->ring);
+    if (!sqe)
+      return -1;
+  }
+
+  sqe->fd = s->sockets[req->index].sock;
+  sqe->user_data = req - u->reqs;
+
+  if (req->op == URING_RECV) {
+    /* Anything the host sends to us is read and discarded */
+    sqe->opcode = IORING_OP_RECV;
+    sqe->addr = (unsigned long)read_buf;
+    sqe->len = sizeof(read_buf);
+  } else if (e_proto == SOCK_STREAM && req->fixed >= 0) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->addr = (unsigned long)(req->buf + req->off);
+    sqe->len = req->len;
+    sqe->buf_index = req->fixed;
+  } else if (e_proto == SOCK_STREAM) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (unsigned long)(req->buf + req->off);
+    sqe->len = req->len;
+  } else {
+    req->iov.iov_base = req->buf + req->off;
+    req->iov.iov_len = req->len;
+    memset(&req->msg, 0, sizeof(req->msg));
+    req->msg.msg_name = (void *)&udp->sa;
+    req->msg.msg_namelen = SIZEOF_SOCKADDR(*udp);
+    req->msg.msg_iov = &req->iov;
+    req->msg.msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (unsigned long)&req->msg;
+    sqe->len = 1;
+  }
+
+  return 0;
+}
+
+/* Submits queued requests and processes completions, waiting for at least
+   <wait> completions.  Returns -1 if sending failed. */
+
+static int uring_engine_reap(struct uring_engine *u, struct sockets *s,
+			     unsigned int wait)
+{
+  struct io_uring_cqe *cqe;
+  struct uring_req *req;
+  int res;
+
+  if (uring_submit(u->ring, wait) < 0) {
+    fprintf(stderr, "io_uring_enter(): %s (%d) (pid %d)\n", strerror(errno),
+	    errno, getpid());
+    return -1;
+  }
+
+  while ((cqe = uring_peek_cqe(u->ring))) {
+    req = &u->reqs[cqe->user_data];
+    res = cqe->res;
+    uring_cqe_seen(u->ring);
+
+    if (req->op == URING_RECV) {
+      /* Keep reading until EOF or error */
+      if (res > 0 && !uring_engine_queue(u, s, req))
+	continue;
+      u->busy[req->index - u->offset] &= ~URING_BUSY_RECV;
+      req->next = u->free_recv;
+      u->free_recv = req;
+      continue;
+    }
+
+    if (res < 0) {
+      fprintf(stderr, "send(sock:%d %d): %s (%d) (pid %d)\n",
+	      s->sockets[req->index].sock, req->index, strerror(-res), -res,
+	      getpid());
+      u->error = 1;
+    } else if (e_proto == SOCK_STREAM && res < req->len) {
+      /* Send the rest */
+      req->off += res;
+      req->len -= res;
+      if (!uring_engine_queue(u, s, req))
+	continue;
+      u->error = 1;
+    }
+
+    u->busy[req->index - u->offset] &= ~URING_BUSY_SEND;
+    u->inflight--;
+    req->next = u->free;
+    u->free = req;
+  }
+
+  return u->error ? -1 : 0;
+}
+
+/* Queues <num> packets to the host.  Packets are submitted when the
+   submission queue fills up or the send loop flushes the batch. */
+
+static int uring_engine_send(struct uring_engine *u, struct worker *w,
+			     int index, void *data, unsigned int len, int num)
+{
+  struct sockets *s = w->s;
+  struct uring_req *req;
+  int i, varies = e_unique || e_diag || e_random_ip || e_random_lport ||
+    (e_lip_start && e_lip_end);
+
+  for (i = 0; i < num; i++) {
+    /* One send in flight per TCP connection keeps the stream in order */
+    while ((e_proto == SOCK_STREAM &&
+	    u->busy[index - u->offset] & URING_BUSY_SEND) ||
+	   !u->free)
+      if (uring_engine_reap(u, s, 1) < 0)
+	return -1;
+
+    send_data_prepare(w, index, data, len);
+
+    req = u->free;
+    u->free = req->next;
+    req->op = URING_SEND;
+    req->index = index;
+    req->off = 0;
+    req->len = len;
+    if (varies) {
+      req->buf = u->slots + ((req - u->reqs) * u->len);
+      memcpy(req->buf, data, len);
+      req->fixed = u->fixed ? 1 : -1;
+    } else {
+      req->buf = data;
+      req->fixed = u->fixed ? 0 : -1;
+    }
+
+    u->inflight++;
+    if (uring_engine_queue(u, s, req) < 0)
+      return -1;
+
+    if (e_proto != SOCK_STREAM)
+      continue;
+    u->busy[index - u->offset] |= URING_BUSY_SEND;
+
+    /* Drain incoming data from the connection */
+    if (!(u->busy[index - u->offset] & URING_BUSY_RECV)) {
+      req = u->free_recv;
+      u->free_recv = req->next;
+      req->op = URING_RECV;
+      req->index = index;
+      if (uring_engine_queue(u, s, req) < 0)
+	return -1;
+      u->busy[index - u->offset] |= URING_BUSY_RECV;
+    }
+  }
+
+  return num;
+}
+#endif /* __linux__ */
+
+/* Submits packets queued with send_data_batch.  If <all> is set waits
+   until all packets have been sent.  Returns -1 on error. */
+
+int send_batch_flush(struct worker *w, int all)
+{
+#ifdef __linux__
+  struct send_batch *b = w->batch;
+
+  if (!b || !b->uring)
+    return 0;
+
+  if (uring_engine_reap(b->uring, w->s, 0) < 0)
+    return -1;
+
+  while (all && b->uring->inflight)
+    if (uring_engine_reap(b->uring, w->s, 1) < 0)
+      return -1;
+#endif /* __linux__ */
+
+  return 0;
+}
+
+/* Returns the number of packets to send to each socket on one round of
+   the send loop.  Only UDP and raw IPv4 packets are batched, and only when
+   sending as fast as possible or at the -s rate.  With UDP GSO the default
+   batch is one full super-datagram. */
+
+int send_batch_size(int paced, int loop, int loops)
+{
+  int num = e_batch;
+
+  if (num < 2 && e_gso)
+    num = gso_segments(e_data_len);
+
+  if (num < 2 || e_proto == SOCK_STREAM ||
+      (e_proto == SOCK_RAW && e_want_ip6) ||
+      (!e_data_flood && !paced))
+    return 1;
+
+  /* Don't go over the requested number of loops */
+  if (loop >= 0 && num > loops - loop)
+    num = loops - loop;
+
+  return num;
+}
+
+/* Sends <num> packets to the host with one sendmmsg() call.  With UDP GSO
+   the packets are sent back to back in super-datagrams, which the kernel
+   segments to <len> sized packets.  Returns the number of packets sent or
+   -1 on error. */
+
+int send_data_batch(struct worker *w, int index, int num)
+{
+  struct sockets *s = w->s;
+  struct send_batch *b = w->batch;
+  unsigned char *data = w->data;
+  unsigned int len = w->len;
+#ifdef __linux__
+  int ret, i, sent, nmsgs, segs;
+  int sock = s->sockets[index].sock;
+  c_sockaddr *udp = &s->sockets[index].udp_dest;
+  int varies = e_unique || e_diag || e_random_ip || e_random_lport ||
+    (e_lip_start && e_lip_end);
+
+  if (e_engine == ENGINE_URING && b && !(e_proto == SOCK_RAW && e_want_ip6)) {
+    if (!b->uring) {
+      b->uring = uring_engine_create(w, data, len);
+      if (!b->uring) {
+	fprintf(stderr, "conntest: io_uring not available, using -E sync\n");
+	e_engine = ENGINE_SYNC;
+      }
+    }
+    if (b->uring)
+      return uring_engine_send(b->uring, w, index, data, len, num);
+  }
+
+  if (num < 2 || !b)
+    return send_data(w, index, data, len) < 0 ? -1 : 1;
+
+  if (num > b->num)
+    num = b->num;
+
+  segs = e_gso && b->segs > 1 ? b->segs : 1;
+
+  for (i = 0; i < num; i++) {
+    send_data_prepare(w, index, data, len);
+
+    /* Every packet gets its own copy if the payload changes per packet.
+       GSO needs the packets back to back but constant data is copied
+       only once. */
+    if (varies || (segs > 1 && !b->filled))
+      memcpy(b->buf + (i * b->len), data, len);
+  }
+  if (segs > 1 && !varies && num == b->num)
+    b->filled = 1;
+
+  nmsgs = (num + segs - 1) / segs;
+  for (i = 0; i < nmsgs; i++) {
+    if (varies || segs > 1)
+      b->iov[i].iov_base = b->buf + (i * segs * b->len);
+    else
+      b->iov[i].iov_base = data;
+    b->iov[i].iov_len = (num - (i * segs) < segs ? num - (i * segs) : segs) *
+      len;
+
+    memset(&b->msgs[i], 0, sizeof(b->msgs[i]));
+    b->msgs[i].msg_hdr.msg_name = (void *)&udp->sa;
+    b->msgs[i].msg_hdr.msg_namelen = SIZEOF_SOCKADDR(*udp);
+    b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+#ifdef SO_TXTIME
+    /* A GSO super-datagram leaves at the launch time of its first packet */
+    if (w->pacer.mode == PACE_TXTIME)
+      send_txtime(w, &b->msgs[i].msg_hdr, b->ctrl + (i * SEND_CTRL_LEN),
+		  b->iov[i].iov_len / len);
+#endif /* SO_TXTIME */
+  }
+
+  for (sent = 0; sent < nmsgs; sent += ret) {
+    ret = sendmmsg(sock, b->msgs + sent, nmsgs - sent, 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+	ret = 0;
+      else {
+	fprintf(stderr, "sendmmsg(sock:%d %d): %s (%d) (pid %d)\n", sock,
+		index, strerror(errno), errno, getpid());
+	return -1;
+      }
+    }
+  }
+
+  return num;
+#else
+  int i;
+
+  for (i = 0; i < num; i++)
+    if (send_data(w, index, data, len) < 0)
+      return -1;
+
+  return num;
+#endif /* __linux__ */
+}
+
 void usage_help(void)
 {
   printf("Usage (client): conntest CLIENT-OPTIONS COMMON-OPTIONS\n");
@@ -1142,16 +2414,26 @@ void usage_help(void)
   printf(" -b               Use random source port when -P is 'raw' or integer value (ipv4)\n");
   printf(" -t <number>      Number of threads to create (default: 1)\n");
   printf(" -c <number>      Number of connections (default: 1)\n");
+  printf(" -X <number>      Connect in parallel at <number> conn/s, 0 no limit (TCP)\n");
+  printf(" -Z <number>      Max connects in progress with -X (default: 1000)\n");
   printf(" -d <length>      Length of data to transmit, bytes (default: 1024)\n");
   printf(" -D <string>      Data header to packet, if starts with 0x string must be HEX\n");
   printf(" -Q <file>        Data from file, if -P is 'raw' data must include IP header\n");
   printf(" -O               Diagnostics traffic to test network behavior\n");
+  printf(" -e               Measure round trip times from echo server (with -O)\n");
   printf(" -l <number>      Number of loops to send data (default: infinity)\n");
   printf(" -n <msec>        Data send interval (ignored with -F) (default: 1000 msec)\n");
   printf(" -s <speed><unit> Rate/sec, Units: SI: kbit, Mbit, Gbit, IEC-27: Kib, Mib, Gib\n");
+  printf(" -j <bytes>       Burst size with -s (default: 10 msec of traffic)\n");
+  printf(" -k               Kernel pacing with -s, needs fq qdisc with UDP and raw\n");
+  printf(" -y <file>        Traffic profile to pace with instead of -s, see README\n");
+  printf(" -w <number>      Open loop, requests/sec at random times (with -e or http)\n");
   printf(" -m <pmtu>        PMTU discovery: 0 no PMTU, 2 do PMTU, 3 set DF, ignore PMTU\n");
   printf(" -B <bitmask>     TCP flags bitmask (8 bits), -P is 6 for TCP (ipv4)\n");
   printf(" -F               Flood, no delays between data sends (default: undefined)\n");
+  printf(" -M <number>      UDP/raw packets to send per system call with -F or -s\n");
+  printf(" -U               UDP GSO, send -d sized packets in 64KB super-datagrams\n");
+  printf(" -E <engine>      I/O engine, 'sync' or 'uring' (io_uring) (default: sync)\n");
 
   printf("\nClient protocols:\n");
   printf(" -A <protocol>    Do <protocol> attack\n");
@@ -1160,6 +2442,11 @@ void usage_help(void)
   printf("    -i <ip>       Aggressive mode identity (default: 0.0.0.0) (ike-aggr only)\n");
   printf("    -g <group>    IKE group (default: 2)\n");
   printf("    -a <auth>     Auth method (psk, rsa, dss, xauth-psk, xauth-rsa, xauth-dss)\n");
+  printf("    http          HTTP GET load over keep-alive connections (not an attack)\n");
+  printf("    -D <uri>      URI to request (default: /) (http only)\n");
+  printf("    -N <number>   Requests pipelined per connection, max 32 (default: 1)\n");
+  printf("    -l <number>   Requests per connection (default: infinity) (http only)\n");
+  printf("    -n <msec>     Statistics print interval (http only)\n");
 
   printf("\nServer options:\n");
   printf(" -S <mode>        Server mode\n");
@@ -1174,7 +2461,13 @@ void usage_help(void)
 #endif /* MAX_SOCKETS */
 	);
   printf(" -D <path>        HTTP pages path for HTTP server (default: current directory)\n");
+  printf(" -z <msec>        HTTP file change check interval (default: 1000 msec)\n");
+  printf(" -Y <file>        MIME types file, eg. /etc/mime.types (default: built-in)\n");
   printf(" -n <msec>        Statistics print interval\n");
+  printf(" -t <number>      Number of threads to create (default: 1)\n");
+  printf(" -W               Each thread has own SO_REUSEPORT listener (with -t)\n");
+  printf(" -M <number>      UDP datagrams to receive per system call (default: 64)\n");
+  printf(" -U               UDP GRO, receive coalesced datagrams\n");
   printf(" -G               Print global statistics (no per-connection stats)\n");
   printf(" -o               CSV output instead of default output\n");
   printf(" -Q <filename>    Output to file\n");
@@ -1204,6 +2497,8 @@ void usage_examples(void)
   printf("      conntest -P 1 -r -h 1.1.1.1\n");
   printf("      conntest -P raw -r -D 0x45000000000000000001 -h 1.1.1.1\n");
   printf("      conntest -P raw -r -D 0x4500000000000000000100000000000001010101\n");
+  printf("  - Send UDP data to 10.2.1.7 port 1234 with the rates of profile.txt:\n");
+  printf("      conntest -h 10.2.1.7 -P udp -p 1234 -c 10 -y profile.txt\n");
 
   printf("\n");
   printf("Server examples:\n");
@@ -1228,6 +2523,81 @@ static void *memdup(void *x, int l)
   return tmp;
 }
 
+/* Allocates <num> workers, each on its own cache lines */
+
+static struct worker *workers_alloc(int num)
+{
+  struct worker *w;
+
+  if (posix_memalign((void **)&w, CACHE_LINE, num * sizeof(*w)))
+    return NULL;
+  memset(w, 0, num * sizeof(*w));
+
+  return w;
+}
+
+/* Returns 1 if the TSC runs at constant rate in all power states */
+
+static int tsc_invariant(void)
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  unsigned int a, b, c, d;
+
+  if (!__get_cpuid(0x80000007, &a, &b, &c, &d))
+    return 0;
+  return (d >> 8) & 1;
+#else
+  return rdtsc() != 0;
+#endif
+}
+
+/* Reads the TSC and CLOCK_MONOTONIC_RAW as close together as possible */
+
+static void tsc_sample(unsigned long long *tsc, unsigned long long *ns)
+{
+  struct timespec a, b;
+  unsigned long long t, d, best = ~0ULL;
+  int i;
+
+  *tsc = *ns = 0;
+  for (i = 0; i < 5; i++) {
+    clock_gettime(CLOCK_MONOTONIC_RAW, &a);
+    t = rdtsc();
+    clock_gettime(CLOCK_MONOTONIC_RAW, &b);
+    d = (b.tv_sec - a.tv_sec) * 1000000000ULL + b.tv_nsec - a.tv_nsec;
+    if (d < best) {
+      best = d;
+      *tsc = t;
+      *ns = a.tv_sec * 1000000000ULL + a.tv_nsec + d / 2;
+    }
+  }
+}
+
+/* Selects the time source of ticks() and sets its frequency to e_freq,
+   ticks per millisecond.  Invariant TSC is calibrated against
+   CLOCK_MONOTONIC_RAW over FREQ_CALIBRATE msec, anything else falls back
+   to clock_gettime(). */
+
+static void freq_init(void)
+{
+  unsigned long long t1, n1, t2, n2;
+
+  if (e_freq)
+    return;
+
+  if (!tsc_invariant()) {
+    e_tsc = 0;
+    e_freq = 1000000;
+    return;
+  }
+
+  tsc_sample(&t1, &n1);
+  usleep(FREQ_CALIBRATE * 1000);
+  tsc_sample(&t2, &n2);
+  e_freq = (double)(t2 - t1) * 1000000.0 / (double)(n2 - n1);
+  e_tsc = 1;
+}
+
 static inline int frame_size(int data_len)
 {
   /* Ethernet + IP header */
@@ -1244,79 +2614,323 @@ static inline int frame_size(int data_len)
   return data_len * 8;
 }
 
-static inline int speed_adjust(int speed, int len, unsigned long long c,
-			       unsigned long long count)
+/* Parses rate in the -s units to bits per second.  Returns -1 if it is
+   not a rate. */
+
+static double rate_parse(const char *str)
+{
+  char *unit;
+  double rate = strtod(str, &unit);
+
+  if (unit == str || rate < 0)
+    return -1;
+  if (!*unit || !strcmp(unit, "bit"))
+    return rate;
+  if (!strcmp(unit, "kbit"))
+    return rate * KBIT;
+  if (!strcmp(unit, "Kib"))
+    return rate * KIBIT;
+  if (!strcmp(unit, "Mbit"))
+    return rate * MBIT;
+  if (!strcmp(unit, "Mib"))
+    return rate * MIBIT;
+  if (!strcmp(unit, "Gbit"))
+    return rate * GBIT;
+  if (!strcmp(unit, "Gib"))
+    return rate * GIBIT;
+  return -1;
+}
+
+/* Loads traffic profile.  Each line is one segment, run in order:
+
+     step <sec> <rate>
+     ramp <sec> <from rate> <to rate>
+     burst <sec> <rate> <on msec> <off msec>
+     poisson <sec> <mean rate>
+     loop
+
+   Returns NULL on error. */
+
+struct profile *profile_load(const char *filename)
 {
-  double tmp;
+  struct profile *pr;
+  struct profile_seg *seg;
+  char line[256], shape[16], a1[32], a2[32], a3[32], *p;
+  double sec;
+  int n, lnum = 0;
+  FILE *fp;
+
+  fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "conntest: %s: %s\n", filename, strerror(errno));
+    return NULL;
+  }
+
+  pr = calloc(1, sizeof(*pr));
+  if (!pr) {
+    fclose(fp);
+    return NULL;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    lnum++;
+    p = strchr(line, '#');
+    if (p)
+      *p = '\0';
+
+    n = sscanf(line, "%15s %lf %31s %31s %31s", shape, &sec, a1, a2, a3);
+    if (n <= 0)
+      continue;
+    if (n == 1 && !strcmp(shape, "loop")) {
+      pr->loop = 1;
+      continue;
+    }
+
+    seg = realloc(pr->seg, (pr->num + 1) * sizeof(*seg));
+    if (!seg)
+      goto err;
+    pr->seg = seg;
+    seg += pr->num;
+    memset(seg, 0, sizeof(*seg));
+    seg->len = sec * 1000000000.0;
+
+    if (!strcmp(shape, "step") && n == 3) {
+      seg->shape = PROFILE_STEP;
+      seg->rate = rate_parse(a1);
+    } else if (!strcmp(shape, "ramp") && n == 4) {
+      seg->shape = PROFILE_RAMP;
+      seg->rate = rate_parse(a1);
+      seg->rate2 = rate_parse(a2);
+    } else if (!strcmp(shape, "burst") && n == 5) {
+      seg->shape = PROFILE_BURST;
+      seg->rate = rate_parse(a1);
+      seg->on = atoi(a2) * 1000000ULL;
+      seg->off = atoi(a3) * 1000000ULL;
+      if (atoi(a2) <= 0 || atoi(a3) < 0)
+	seg->rate = -1;
+    } else if (!strcmp(shape, "poisson") && n == 3) {
+      seg->shape = PROFILE_POISSON;
+      seg->rate = rate_parse(a1);
+    } else {
+      seg->rate = -1;
+    }
+
+    if (sec <= 0 || !seg->len || seg->rate < 0 || seg->rate2 < 0) {
+      fprintf(stderr, "conntest: %s:%d: Invalid profile segment\n",
+	      filename, lnum);
+      goto err;
+    }
+
+    pr->total += seg->len;
+    pr->num++;
+  }
 
-  /* Adjust sleep interval 10 times per second, spread evenly among all
-     threads. */
-  tmp = (double)frame_size(len) * ((double)c / (double)count);
-  tmp = tmp / (double)(((e_speed * e_speed_unit) / (double)10) / e_threads);
-  if (tmp < 0.99f || tmp > 1.01f) {
-    tmp = (double)speed * tmp;
-    speed = tmp + 0.5f;
-    if (speed < 1)
-      speed = 1;
+  if (!pr->num) {
+    fprintf(stderr, "conntest: %s: Empty profile\n", filename);
+    goto err;
   }
 
-  return speed;
+  fclose(fp);
+  return pr;
+
+ err:
+  fclose(fp);
+  free(pr->seg);
+  free(pr);
+  return NULL;
 }
 
-static int speed_per_usec(int data_len)
+/* Returns the profile rate, bits per second, at <t> ns from the start,
+   or -1 if the profile has ended.  Returns also the time when the rate
+   changes next, and whether the inter-arrivals are exponential. */
+
+static double profile_rate(struct profile *pr, unsigned long long t,
+			   unsigned long long *until, int *poisson)
 {
-  double s;
-  unsigned long long v;
+  struct profile_seg *seg = pr->seg;
+  unsigned long long base = 0, start = 0, ph;
+  int i;
 
-  if (!e_speed)
-    return -1;
+  if (t >= pr->total) {
+    if (!pr->loop)
+      return -1;
+    base = t - t % pr->total;
+    t %= pr->total;
+  }
 
-  v = rdtsc();
-  if (!v) {
-    fprintf(stderr, "conntest: rdtsc not available on this platform, -s option is ignored\n");
-    return -1;
+  for (i = 0; i < pr->num - 1 && t >= start + seg[i].len; i++)
+    start += seg[i].len;
+  seg += i;
+
+  *until = base + start + seg->len;
+  *poisson = seg->shape == PROFILE_POISSON;
+
+  switch (seg->shape) {
+  case PROFILE_RAMP:
+    if (*until > base + t + PROFILE_RAMP_NS)
+      *until = base + t + PROFILE_RAMP_NS;
+    return seg->rate + (seg->rate2 - seg->rate) * (t - start) / seg->len;
+
+  case PROFILE_BURST:
+    ph = (t - start) % (seg->on + seg->off);
+    if (ph < seg->on) {
+      if (*until > base + t + seg->on - ph)
+	*until = base + t + seg->on - ph;
+      return seg->rate;
+    }
+    if (*until > base + t + seg->on + seg->off - ph)
+      *until = base + t + seg->on + seg->off - ph;
+    return 0;
+
+  default:
+    return seg->rate;
   }
-  usleep(100000);
-  v = rdtsc() - v;
-  v *= 10;
-  e_freq = v / 1000; /* ms */
+}
 
-  data_len = frame_size(data_len);
+/* Returns the average profile rate, bits per second, from <from> to
+   <to> ns from the start */
 
-  s = e_speed * e_speed_unit;
-  s /= (double)data_len;
+static double profile_average(struct profile *pr, unsigned long long from,
+			      unsigned long long to)
+{
+  unsigned long long t, until;
+  double bits = 0, rate;
+  int poisson;
 
-  if (!s)
-    s = 1;
+  for (t = from; t < to; t = until) {
+    rate = profile_rate(pr, t, &until, &poisson);
+    if (rate < 0)
+      break;
+    if (until > to)
+      until = to;
+    bits += rate * (until - t);
+  }
 
-  s = 1000000 / s;
-  e_num_pkts = 1;
+  return to > from ? bits / (to - from) : 0;
+}
 
-  /* Minimum sleep time of ~1ms */
-  if (s < 1000) {
-    if (s)
-      s = 1000 / s;
-    else
-      s = 1000;
-    data_len *= s;
-    e_num_pkts = s + 0.5f;
-    s = e_speed * e_speed_unit;
-    s /= (double)data_len;
+/* Returns exponentially distributed random number with mean of 1 */
 
-    if (!s)
-      s = 1;
+static inline double rand_exp(unsigned long long *s)
+{
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return -log(((*s >> 11) + 0.5) / 9007199254740992.0);
+}
 
-    s = 1000000 / s;
+/* Sets the pacer's rate, bits per second, and the burst size with it.  The
+   default burst is PACE_BURST msec of traffic, and at least two packets,
+   so that oversleeping is not lost.  With launch times packets are queued
+   to the kernel at most PACE_LEAD msec ahead. */
+
+static void pacer_rate(struct pacer *p, double rate)
+{
+  p->rate = rate / 1000000000.0;
+  if (e_burst) {
+    p->burst = (double)e_burst * 8 * p->share;
+    if (p->burst < p->frame)
+      p->burst = p->frame;
+  } else {
+    p->burst = p->rate * 1000000 * PACE_BURST;
+    if (p->burst < p->frame * 2)
+      p->burst = p->frame * 2;
   }
+  p->lead = p->rate * 1000000 * PACE_LEAD;
+  if (p->lead > p->burst)
+    p->lead = p->burst;
+  p->gap = p->rate > 0 ? p->frame / p->rate : 0;
+}
 
-  if (e_num_pkts > e_threads)
-    e_num_pkts = (e_num_pkts + e_threads - 1) / e_threads;
-  else if (e_threads > 1) {
-    fprintf(stderr, "conntest: Fallback to 1 thread with selected speed\n");
-    e_threads = 1;
+/* Follows the -y profile to time <now>.  Returns -1 if it has ended. */
+
+static int pacer_profile(struct pacer *p, unsigned long long now)
+{
+  unsigned long long until;
+  int poisson;
+  double rate;
+
+  rate = profile_rate(e_profile, now - g_profile_start, &until, &poisson);
+  if (rate < 0)
+    return -1;
+
+  pacer_rate(p, rate * p->share);
+  p->until = g_profile_start + until;
+  if (poisson != p->poisson) {
+    p->poisson = poisson;
+    p->cost = poisson ? p->frame * rand_exp(&p->rnd) : p->frame;
   }
 
-  return s;
+  return 0;
+}
+
+/* Gives the pacer <share> of the -s rate, of the -y profile, or of the -w
+   open loop request rate */
+
+static void pacer_init(struct pacer *p, int data_len, double share,
+		       int seed)
+{
+  if ((!e_speed && !e_profile && e_open_rate <= 0) || e_data_flood ||
+      share <= 0)
+    return;
+
+  if (e_kpace)
+    p->mode = e_proto == SOCK_STREAM ? PACE_RATE :
+      e_engine == ENGINE_URING ? PACE_USER : PACE_TXTIME;
+
+  p->frame = frame_size(data_len);
+  p->share = share;
+  p->cost = p->frame;
+  p->rnd = 0x9e3779b97f4a7c15ULL * (seed + 1);
+  p->tokens = p->frame;
+  p->last = mono_ns();
+  if (e_open_rate > 0) {
+    p->open = 1;
+    p->gap = 1000000000.0 / (e_open_rate * share);
+    p->next = p->last + p->gap * rand_exp(&p->rnd);
+  } else if (e_profile)
+    pacer_profile(p, p->last);
+  else
+    pacer_rate(p, (double)e_speed * e_speed_unit * share);
+}
+
+/* Gives each TCP socket of the worker an equal part of its pacer share
+   of the -s rate as the maximum pacing rate.  If the kernel can't do it
+   the rate is paced in user space. */
+
+static void kernel_pace_rate(struct worker *w)
+{
+#if defined(SO_MAX_PACING_RATE)
+  unsigned int rate;
+  double r;
+  int i;
+
+  r = (double)e_speed * e_speed_unit / 8 * w->pacer.share / w->num;
+  rate = r < 4294967295.0 ? (unsigned int)(r + 0.5) : 4294967295U;
+  for (i = w->offset; i < w->offset + w->num; i++)
+    if (set_sockopt2(w->s->sockets[i].sock, SOL_SOCKET, SO_MAX_PACING_RATE,
+		     &rate, sizeof(rate)) < 0)
+      break;
+  if (i == w->offset + w->num)
+    return;
+#endif /* SO_MAX_PACING_RATE */
+
+  if (e_kpace)
+    fprintf(stderr, "conntest: Kernel pacing not supported, -k is ignored\n");
+  e_kpace = 0;
+  w->pacer.mode = PACE_USER;
+}
+
+/* Returns the intended send time of the next request in open loop, and
+   schedules the one after it.  The schedule does not wait for the sends,
+   so a stalled send doesn't delay the requests after it. */
+
+static inline unsigned long long pacer_next(struct pacer *p)
+{
+  unsigned long long t = p->next;
+
+  p->next += p->gap * rand_exp(&p->rnd);
+  return t;
 }
 
 #define GET_SEPARATED(x, s, ret1, ret2)					\
@@ -1334,14 +2948,15 @@ do {									\
 
 int main(int argc, char **argv)
 {
-  int i, k, l, count = 0, speed;
+  int i, k, l, num, bnum, count = 0;
   char *data, opt;
-  unsigned long long v, vtot = 0, c = 0;
   struct rlimit rlim;
-  int len, cpkts;
+  int len;
   struct sockets s;
+  struct connector cc;
   char fdata[32000];
   FILE *f;
+  struct worker *workers, *w;
 
 #ifdef WIN32
   WORD ver = MAKEWORD( 2, 2 );
@@ -1364,7 +2979,7 @@ int main(int argc, char **argv)
   if (argc > 1) {
     k = 1;
     while((opt = getopt(argc, argv,
-			"Vh:H:p:P:c:d:l:t:fFA:i:g:a:n:s:D:Q:L:K:uR:m:T:rq64xI:S:bB:C:oOG"))
+			"Vh:H:p:P:c:d:l:t:fFA:i:g:a:n:s:D:Q:L:K:uR:m:T:rq64xI:S:bB:C:oOGM:UE:Wz:Y:N:eX:Z:j:ky:w:"))
 	  != EOF) {
       switch(opt) {
       case 'V':
@@ -1566,18 +3181,43 @@ int main(int argc, char **argv)
           k++;
 	}
         break;
-      case 'I':
+      case 'w':
         k++;
         if (argv[k] == (char *)NULL)
           usage();
-        e_ifname = strdup(argv[k]);
+        e_open_rate = atof(argv[k]);
         k++;
         break;
-      case 'f':
+      case 'y':
         k++;
-        e_flood = 1;
-        break;
-      case 'F':
+        if (argv[k] == (char *)NULL)
+          usage();
+        e_profile_file = argv[k];
+        k++;
+        break;
+      case 'k':
+        e_kpace = 1;
+        k++;
+        break;
+      case 'j':
+        k++;
+        if (argv[k] == (char *)NULL)
+          usage();
+        e_burst = atoi(argv[k]);
+        k++;
+        break;
+      case 'I':
+        k++;
+        if (argv[k] == (char *)NULL)
+          usage();
+        e_ifname = strdup(argv[k]);
+        k++;
+        break;
+      case 'f':
+        k++;
+        e_flood = 1;
+        break;
+      case 'F':
         k++;
         e_data_flood = 1;
         break;
@@ -1597,6 +3237,8 @@ int main(int argc, char **argv)
 	  e_do_ike = 1;
 	  e_ike_attack = IKE_ATTACK_MM;
         }
+	if (!strcasecmp(argv[k], "http"))
+	  e_do_http = 1;
         k++;
 	break;
       case 'S':
@@ -1698,10 +3340,82 @@ int main(int argc, char **argv)
         k++;
         e_diag = 1;
 	break;
+      case 'e':
+        k++;
+        e_rtt = 1;
+	break;
+      case 'X':
+        k++;
+        if (argv[k] == (char *)NULL)
+          usage();
+        e_connect_rate = atoi(argv[k]);
+        if (e_connect_rate < 0)
+          usage();
+        k++;
+        break;
+      case 'Z':
+        k++;
+        if (argv[k] == (char *)NULL)
+          usage();
+        e_connect_window = atoi(argv[k]);
+        if (e_connect_window < 1)
+          usage();
+        k++;
+        break;
       case 'G':
         k++;
         e_gstats = 1;
         break;
+      case 'M':
+        k++;
+        if (argv[k] == (char *)NULL)
+          usage();
+        e_batch = atoi(argv[k]);
+        k++;
+        break;
+      case 'U':
+        k++;
+        e_gso = 1;
+        break;
+      case 'E':
+        k++;
+        if (argv[k] == (char *)NULL)
+          usage();
+	if (!strcasecmp(argv[k], "sync"))
+	  e_engine = ENGINE_SYNC;
+	else if (!strcasecmp(argv[k], "uring"))
+	  e_engine = ENGINE_URING;
+	else
+	  usage();
+        k++;
+        break;
+      case 'W':
+        k++;
+        e_reuseport = 1;
+        break;
+      case 'z':
+        k++;
+        if (argv[k] == (char *)NULL)
+          usage();
+        e_http_check = atoi(argv[k]);
+        k++;
+        break;
+      case 'Y':
+        k++;
+        if (argv[k] == (char *)NULL)
+          usage();
+        e_mime_types = argv[k];
+        k++;
+        break;
+      case 'N':
+        k++;
+        if (argv[k] == (char *)NULL)
+          usage();
+        e_http_depth = atoi(argv[k]);
+        if (e_http_depth < 1 || e_http_depth > HTTP_PIPELINE)
+          usage();
+        k++;
+        break;
       default:
         usage();
         break;
@@ -1718,6 +3432,8 @@ int main(int argc, char **argv)
     e_num_conn = 1;
   if (e_threads < 1)
     e_threads = 1;
+  if (e_server && e_sleep < 1)
+    e_sleep = 1;
 
   /* Limit for sockets */
   getrlimit(RLIMIT_NOFILE, &rlim);
@@ -1728,8 +3444,47 @@ int main(int argc, char **argv)
     setrlimit(RLIMIT_NOFILE, &rlim);
   }
 
+  if (e_connect_rate >= 0 && !e_server &&
+      (e_proto != SOCK_STREAM || e_do_ike)) {
+    fprintf(stderr, "conntest: -X is supported only with TCP\n");
+    exit(1);
+  }
+
+  if (e_profile_file) {
+    if (e_server || e_do_http || e_do_ike ||
+	(e_kpace && e_proto == SOCK_STREAM)) {
+      fprintf(stderr, "conntest: -y is supported only in data client, and not with -k and TCP\n");
+      exit(1);
+    }
+    e_profile = profile_load(e_profile_file);
+    if (!e_profile)
+      exit(1);
+  }
+
+  if (e_open_rate > 0 &&
+      (e_server || e_speed || e_profile || e_kpace || (!e_rtt && !e_do_http))) {
+    fprintf(stderr, "conntest: -w is supported only with -e or http client, and not with -s, -y or -k\n");
+    exit(1);
+  }
+
+  if (e_kpace && ((!e_speed && !e_profile) || e_server || e_do_http ||
+		  e_do_ike)) {
+    fprintf(stderr, "conntest: -k is supported only with -s or -y in data client\n");
+    exit(1);
+  }
+
+  if (e_rtt) {
+    if (e_server || e_do_http || e_do_ike || e_proto == SOCK_RAW ||
+	e_engine == ENGINE_URING) {
+      fprintf(stderr, "conntest: -e is supported only with TCP or UDP client and -E sync\n");
+      exit(1);
+    }
+    if (e_data_len < RTT_HEADER)
+      e_data_len = RTT_HEADER;
+    e_diag = 1;
+  }
+
   if (e_server) {
-    e_threads = 1;
     if (!e_lport) {
       if (e_server_mode == SERVER_DISCARD)
 	e_lport = 9;
@@ -1738,6 +3493,24 @@ int main(int argc, char **argv)
       else if (e_server_mode == SERVER_HTTP)
 	e_lport = 80;
     }
+    /* UDP GRO datagrams can be accounted only with batched receive */
+#if defined(UDP_GRO)
+    if (e_gso && (e_batch == 1 || e_unique || e_hexdump)) {
+      fprintf(stderr, "conntest: -U not supported with -M 1, -u or -x\n");
+      exit(1);
+    }
+#else
+    if (e_gso) {
+      fprintf(stderr, "conntest: -U not supported on this platform\n");
+      exit(1);
+    }
+#endif /* UDP_GRO */
+#ifndef SO_REUSEPORT
+    if (e_reuseport) {
+      fprintf(stderr, "conntest: -W not supported on this platform\n");
+      exit(1);
+    }
+#endif /* !SO_REUSEPORT */
     server();
     exit(0);
   }
@@ -1761,6 +3534,9 @@ int main(int argc, char **argv)
 
   if (e_do_ike) {
     void *ike;
+#ifndef MAX_SOCKETS
+    sockets_alloc(&s, 1);
+#endif /* !MAX_SOCKETS */
     create_connection(e_port, e_host, 0, &s);
     ike = ike_start();
     ike_add(ike, s.sockets[0].sock, &s.sockets[0].udp_dest, e_data_flood, e_ike_identity,
@@ -1798,6 +3574,8 @@ int main(int argc, char **argv)
 	  count++;
     sockets_alloc(&s, count);
 #endif /* !MAX_SOCKETS */
+    if (e_connect_rate >= 0)
+      connect_init(&cc, count);
 
     count = 0;
     for (k = start; k <= end; k++) {
@@ -1816,6 +3594,13 @@ int main(int argc, char **argv)
 
       for (l = e_port; l <= e_port_end; l++) {
         for (i = 0; i < e_num_conn; i++) {
+	  if (e_connect_rate >= 0) {
+	    connect_pace(&cc, &s);
+	    connect_add(&cc, &s, count, create_connection(l, ip, count, &s));
+	    count++;
+	    continue;
+	  }
+
 	  if (!e_quiet)
 	    fprintf(stderr, "#%3d: ", i + 1);
         retry0:
@@ -1841,6 +3626,8 @@ int main(int argc, char **argv)
 	count++;
     sockets_alloc(&s, count);
 #endif /* !MAX_SOCKETS */
+    if (e_connect_rate >= 0)
+      connect_init(&cc, count);
     count = 0;
 
     if (!e_force_ip4 && is_ip6(e_host))
@@ -1849,6 +3636,13 @@ int main(int argc, char **argv)
     /* create the sockets */
     for (l = e_port; l <= e_port_end; l++) {
       for (i = 0; i < e_num_conn; i++) {
+        if (e_connect_rate >= 0) {
+	  connect_pace(&cc, &s);
+	  connect_add(&cc, &s, count, create_connection(l, e_host, count, &s));
+	  count++;
+	  continue;
+	}
+
         if (!e_quiet)
 	  fprintf(stderr, "#%3d: ", i + 1);
       retry:
@@ -1867,8 +3661,23 @@ int main(int argc, char **argv)
     i = count;
   }
 
+  if (e_connect_rate >= 0) {
+    i = connect_finish(&cc, &s, count);
+    if (!i) {
+      fprintf(stderr, "conntest: no connections\n");
+      exit(1);
+    }
+    if (e_threads > i)
+      e_threads = i;
+  }
+
   s.num_sockets = i;
 
+  if (e_do_http) {
+    http_client(&s);
+    exit(0);
+  }
+
   /* generate data */
   len = e_data_len;
   data = (char *)malloc(sizeof(char) * len + 1);
@@ -1899,139 +3708,79 @@ int main(int argc, char **argv)
     }
   }
 
-  speed = speed_per_usec(len);
-  cpkts = e_num_pkts;
-
-  /* do the data sending (if single thread) */
-  if (e_threads == 1) {
-    if (!e_quiet)
-      fprintf(stderr, "Sending data (%d bytes) to connection n:o ", len);
-    if (e_send_loop < 0)
-      k = -2;
-    else
-      k = 0;
-
-    c = count = 0;
-    while(k < e_send_loop) {
-      for (i = 0; i < s.num_sockets; i++) {
-        v = rdtsc();
-
-	if (!e_quiet) {
-	  fprintf(stderr, "%5d\b\b\b\b\b", i + 1);
-	  fflush(stderr);
-	}
+  bnum = e_batch > 1 ? e_batch : gso_segments(len);
+  if (e_rtt && !e_freq)
+    freq_init();
 
-        if ((send_data(&s, i, data, len)) < 0) {
-          free(data);
-          exit(1);
-        }
-
-        if (!e_data_flood) {
-	  if (speed != -1) {
-            if (--cpkts == 0) {
-	      bsleep(speed);
-	      cpkts = e_num_pkts;
-	    }
-
-	    c++;
-	    vtot += rdtsc() - v;
-	    if ((double)vtot / (double)e_freq >= 100) {
-	      vtot = 0;
-	      count++;
-	      speed = speed_adjust(speed, len, c, count);
-	    }
-	  } else if (e_sleep * 1000 < 1000000)
-            usleep(e_sleep * 1000);
-	  else
-	    sleep(e_sleep / 1000);
-	}
-      }
-      if (k >= 0)
-        k++;
-    }
+  workers = workers_alloc(e_threads);
+  if (!workers) {
+    fprintf(stderr, "conntest: Out of memory\n");
+    exit(1);
   }
-#ifndef WIN32
-    else {               /* >1 threads */
-    int num, offset;
-
-    /* Generate the threads. Every thread is supposed to have
-       equal number of connections (if divides even). */
-    offset = 0;
-    if (e_num_conn < s.num_sockets)
-      num = s.num_sockets / e_threads;
-    else
-      num = e_num_conn / e_threads;
-    for (i = 0; i < e_threads; i++) {
-      if (i)
-        offset += num;
-
-      if (i == e_threads - 1)
-        break;
 
-      if (fork())
-        continue;
+  if (!e_quiet) {
+    fprintf(stderr, "Sending data (%d bytes) to connection n:o ", len);
+    fflush(stderr);
+  }
 
-      /* thread calls */
-      thread_data_send(&s, offset, num, e_send_loop, data, len, e_data_flood);
+  /* Generate the threads. Every thread is supposed to have equal number
+     of connections (if divides even), the last one takes the rest. */
+  num = s.num_sockets / e_threads;
+  g_profile_start = mono_ns();
+  for (i = 0; i < e_threads; i++) {
+    w = &workers[i];
+    w->id = i;
+    w->s = &s;
+    w->offset = i * num;
+    w->num = i == e_threads - 1 ? s.num_sockets - w->offset : num;
+    w->time = e_time * (i + 1);
+    w->diag = e_diag;
+    w->lip_s = e_lip_s;
+    pacer_init(&w->pacer, len, (double)w->num / s.num_sockets, i);
+    if (w->pacer.mode == PACE_RATE)
+      kernel_pace_rate(w);
+
+    /* Every thread modifies its own copy of the data */
+    w->len = len;
+    w->data = memdup(data, len);
+    if (bnum > 1 || e_engine == ENGINE_URING)
+      w->batch = send_batch_alloc(bnum > 1 ? bnum : 1, len);
+    if (e_rtt) {
+      w->hist = calloc(1, sizeof(*w->hist));
+      w->rtt = calloc(w->num, sizeof(*w->rtt));
     }
-
-    /* Parent will take care of rest of the connections. */
-    if (!e_quiet) {
-      fprintf(stderr, "Sending data (%d bytes) to connection n:o ", len);
-      fflush(stderr);
+    if (!w->data || ((bnum > 1 || e_engine == ENGINE_URING) && !w->batch) ||
+	(e_rtt && (!w->hist || !w->rtt))) {
+      fprintf(stderr, "conntest: Out of memory\n");
+      exit(1);
     }
-    if (e_send_loop < 0)
-      k = -2;
-    else
-      k = 0;
-
-    c = count = 0;
-    num = num + offset > s.num_sockets ? s.num_sockets : num + offset;
-    while(k < e_send_loop) {
-      for (i = offset; i < num; i++) {
-        v = rdtsc();
-
-	if (!e_quiet) {
-	  fprintf(stderr, "%5d\b\b\b\b\b", i + 1);
-	  fflush(stderr);
-	}
 
-        if ((send_data(&s, i, data, len)) < 0) {
-          free(data);
-          exit(1);
-        }
+    if (pthread_create(&w->thread, NULL, thread_data_send, w)) {
+      fprintf(stderr, "pthread_create(): %s\n", strerror(errno));
+      exit(1);
+    }
+  }
 
-        if (!e_data_flood) {
-	  if (speed != -1) {
-            if (--cpkts == 0) {
-	      bsleep(speed);
-	      cpkts = e_num_pkts;
-	    }
+  if (e_rtt && !client_report(workers, e_threads, "Echoes", 1000))
+    exit(0);
+  if (e_profile && !e_rtt && !profile_report(workers, e_threads, len))
+    exit(0);
 
-	    c++;
-	    vtot += rdtsc() - v;
-	    if ((double)vtot / (double)e_freq >= 100) {
-	      vtot = 0;
-	      count++;
-	      speed = speed_adjust(speed, len, c, count);
-	    }
-	  } else if (e_sleep * 1000 < 1000000)
-            usleep(e_sleep * 1000);
-	  else
-	    sleep(e_sleep / 1000);
-	}
-      }
-      if (k >= 0)
-        k++;
-    }
+  for (i = 0; i < e_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    send_batch_free(workers[i].batch);
+    free(workers[i].data);
+    free(workers[i].hist);
+    free(workers[i].rtt);
   }
-#endif
+  free(workers);
+
   /* close the connections */
 
   if (!e_quiet)
     fprintf(stderr, "\nClosing connections.\n");
 
-  for (i = 0; i < e_num_conn; i++)
+  for (i = 0; i < s.num_sockets; i++)
     if ((close_connection(s.sockets[i].sock)) < 0) {
       free(e_header);
       free(data);
@@ -2043,247 +3792,1307 @@ int main(int argc, char **argv)
   return 0;
 }
 
-/* Executing thread. This is the executing child process. */
+/* Records round trip time of echoed packet, <p> is the send time */
 
-void thread_data_send(struct sockets *s, int offset, int num,
-                      int loop, void *data, int datalen, int flood)
+static inline void echo_rtt_add(struct worker *w, const unsigned char *p)
 {
-  int i, k, cpkts = e_num_pkts, count = 0, speed;
-  unsigned long long v, vtot = 0, c;
-  char buf[256];
-
-  /* log the connections */
-  num = num + offset > s->num_sockets ? s->num_sockets : num + offset;
-  sprintf(buf, "PID %d sends data (%d bytes) to %d connections",
-              getpid(), datalen, num);
-  SYSLOG((LOG_INFO, "%s\n", buf));
-
-  e_time = time(NULL) * 2;
+  unsigned long long t, now = mono_ns();
 
-  /* do the data sending */
-  if (loop < 0)
-    k = -2;
-  else
-    k = 0;
+  memcpy(&t, p, sizeof(t));
+  if (t <= now)
+    hist_add(w->hist, now - t);
+  w->stats.reqs++;
+}
 
-  c = count = 0;
-  speed = e_speed != -1 ? 1000 : -1;
+/* Reads the echoes from the connection.  Returns -1 on EOF or error. */
 
-  while(k < loop) {
-    for (i = offset; i < num; i++) {
-      v = rdtsc();
+static int echo_recv(struct worker *w, int index)
+{
+  unsigned char buf[65536], *p;
+  struct echo_rtt *r;
+  int len, n;
 
-      if ((send_data(s, i, data, datalen)) < 0) {
-        SYSLOG((LOG_ERR, "PID %d: Error sending data to connection n:o: %d\n",
-               getpid(), i + 1));
-        free(data);
-        exit(1);
-      }
+  while ((len = recv(w->s->sockets[index].sock, buf, sizeof(buf),
+		     MSG_DONTWAIT)) > 0) {
+    w->stats.recv_bytes += len;
 
-      if (!flood) {
-	if (e_speed != -1) {
-          if (--cpkts == 0) {
-	    bsleep(speed);
-	    cpkts = e_num_pkts;
-	  }
+    if (e_proto != SOCK_STREAM) {
+      if (len >= RTT_HEADER)
+	echo_rtt_add(w, buf + 4);
+      continue;
+    }
 
-	  c++;
-	  vtot += rdtsc() - v;
-	  if ((double)vtot / (double)e_freq >= 100) {
-	    vtot = 0;
-	    count++;
-	    speed = speed_adjust(speed, datalen, c, count);
-	  }
-	} else if (e_sleep * 1000 < 1000000)
-          usleep(e_sleep * 1000);
-	else
-	  sleep(e_sleep / 1000);
+    /* TCP, find the packet headers from the stream */
+    r = &w->rtt[index - w->offset];
+    for (p = buf; len > 0; p += n, len -= n) {
+      if (r->off < RTT_HEADER) {
+	n = RTT_HEADER - r->off < len ? RTT_HEADER - r->off : len;
+	memcpy(r->hdr + r->off, p, n);
+      } else {
+	n = w->len - r->off < len ? w->len - r->off : len;
       }
+      r->off += n;
+      if (r->off == RTT_HEADER)
+	echo_rtt_add(w, r->hdr + 4);
+      if (r->off == w->len)
+	r->off = 0;
     }
-    if (k >= 0)
-      k++;
   }
 
-  /* close the connections */
-  for (i = offset; i < num; i++)
-    if ((close_connection(s->sockets[i].sock)) < 0) {
-      SYSLOG((LOG_ERR, "PID %d: Error closing connection n:o: %d\n",
-             getpid(), i + 1));
-      free(data);
-      exit(1);
-    }
-
-  free(data);
-  exit(0);
+  if (!len || (len < 0 && errno != EAGAIN && errno != EINTR))
+    return -1;
+  return 0;
 }
 
-/******************************* Server mode *******************************/
-
-void thread_server(struct sockets *s, int offset, int num);
+/* Waits for echoes at most <usec> microseconds, 0 only reads what has
+   arrived.  Below a millisecond the wait spins. */
 
-void server(void)
+static void echo_wait(struct worker *w, unsigned int usec)
 {
-  int l, k, i, count;
-  struct sockets s;
-  int num, offset;
-  unsigned long long v;
+  struct epoll_event events[64];
+  unsigned long long end = ticks() + usec * (e_freq / 1000), now;
+  int i, n, timeout;
+
+  do {
+    now = ticks();
+    timeout = now < end ? (end - now) / e_freq : 0;
+    n = epoll_wait(w->epfd, events, 64, timeout);
+    for (i = 0; i < n; i++)
+      if (echo_recv(w, events[i].data.u32) < 0 && e_proto == SOCK_STREAM)
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL,
+		  w->s->sockets[events[i].data.u32].sock, &events[i]);
+  } while (ticks() < end);
+}
 
-  memset(&s, 0, sizeof(s));
+static void echo_start(struct worker *w)
+{
+  struct epoll_event event;
+  int i;
 
-  v = rdtsc();
-  if (!v) {
-    fprintf(stderr, "conntest: rdtsc not available on this platform\n");
+  w->epfd = epoll_create(w->num);
+  if (w->epfd < 0) {
+    SYSLOG((LOG_ERR, "Thread %d: %s\n", w->id, strerror(errno)));
     exit(1);
   }
-  usleep(100000);
-  v = rdtsc() - v;
-  v *= 10;
-  e_freq = v / 1000; /* ms */
 
-  if (e_filename)
-    e_output = fopen(e_filename, "w+");
-  if (!e_output)
-    e_output = stderr;
+  for (i = w->offset; i < w->offset + w->num; i++) {
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->s->sockets[i].sock, &event)) {
+      SYSLOG((LOG_ERR, "Thread %d: %s\n", w->id, strerror(errno)));
+      exit(1);
+    }
+  }
+}
 
-  /* For now local port range support not enabled */
-  e_lport_end = e_lport;
+/* Waits for the remaining echoes until one second passes without any,
+   the rest are counted lost. */
 
-  /* For TCP we must reserve space for incoming connections.  For UDP
-     e_num_conn works are maximum limit. */
-  if (e_num_conn == 1)
-#if defined(MAX_SOCKETS)
-    e_num_conn = MAX_SOCKETS;
-#else
-    e_num_conn = MAX_CONNS;
-#endif /* MAX_SOCKETS */
+static void echo_end(struct worker *w)
+{
+  unsigned long long recv, last = ticks();
+
+  while (w->stats.reqs < w->stats.send_pkts &&
+	 ticks() - last < 1000 * e_freq) {
+    recv = w->stats.reqs;
+    echo_wait(w, 10000);
+    if (w->stats.reqs != recv)
+      last = ticks();
+  }
 
-  if (e_lip_start && e_lip_end) {
-    int start, end;
-    char *scope = NULL;
+  if (w->stats.send_pkts > w->stats.reqs)
+    w->stats.errors = w->stats.send_pkts - w->stats.reqs;
+  close(w->epfd);
+}
 
-    if (!e_force_ip4 && is_ip6(e_lip_start))
-      e_want_ip6 = 1;
+/* Takes tokens for at most <num> packets from the worker's pacer,
+   waiting until at least one packet may be sent.  With launch times the
+   packets may go ahead of time and the kernel holds them until their
+   launch time.  In open loop the packets go one at a time by the -w
+   schedule.  Returns the number of packets to send now, or -1 when the
+   -y profile has ended. */
 
-    if (e_want_ip6) {
-      if (strchr(e_lip_start, '%')) {
-        scope = strdup(strchr(e_lip_start, '%'));
-        *strchr(e_lip_start, '%') = '\0';
-        if (strchr(e_lip_end, '%'))
-          *strchr(e_lip_end, '%') = '\0';
-      }
-      start = strtol(strrchr(e_lip_start, ':') + 1, (char **)NULL, 16);
-      end = strtol(strrchr(e_lip_end, ':') + 1, (char **)NULL, 16);
-    } else {
-      start = atoi(strrchr(e_lip_start, '.') + 1);
-      end = atoi(strrchr(e_lip_end, '.') + 1);
+static int pacer_take(struct worker *w, int num)
+{
+  struct pacer *p = &w->pacer;
+  unsigned long long now, wait;
+  struct timespec ts;
+  double need;
+  int n;
+
+  /* Kernel paces the socket */
+  if (p->mode == PACE_RATE)
+    return num;
+
+  /* Open loop sends one packet at a time at its intended time, late
+     packets right away */
+  if (p->open) {
+    while ((now = mono_ns()) < p->next) {
+      if (e_rtt)
+	echo_wait(w, (p->next - now) / 1000);
+      else
+	sleep_until(p->next);
     }
+    p->intended = p->launch = pacer_next(p);
+    return 1;
+  }
 
-#ifndef MAX_SOCKETS
-    /* Allocate sockets */
-    for (k = start; k <= end; k++)
-      for (l = e_lport; l <= e_lport_end; l++)
-        count++;
-    sockets_alloc(&s, e_num_conn + count);
-#endif /* !MAX_SOCKETS */
+  for (;;) {
+    now = mono_ns();
+    p->tokens += (now - p->last) * p->rate;
+    p->last = now;
+    if (e_profile && now >= p->until && pacer_profile(p, now) < 0)
+      return -1;
+    if (p->tokens > p->burst && p->tokens > p->cost)
+      p->tokens = p->burst > p->cost ? p->burst : p->cost;
 
-    count = 0;
-    for (k = start; k <= end; k++) {
-      /* create sockets */
-      char tmp[128], ip[128];
+    need = p->mode == PACE_TXTIME && p->rate > 0 ?
+      p->cost - p->lead : p->cost;
+    if (p->tokens >= need)
+      break;
+
+    /* Wake up also for the next rate change of the profile */
+    wait = p->rate > 0 ? (need - p->tokens) / p->rate + 1 : ~0ULL;
+    if (e_profile && wait > p->until - now)
+      wait = p->until - now;
+
+    if (e_rtt) {
+      echo_wait(w, (wait + 999) / 1000);
+    } else if (p->mode == PACE_TXTIME) {
+      /* Kernel keeps the time, no need to spin */
+      ts.tv_sec = wait / 1000000000ULL;
+      ts.tv_nsec = wait % 1000000000ULL;
+      nanosleep(&ts, NULL);
+    } else {
+      sleep_until(now + wait);
+    }
+  }
+
+  n = p->poisson ? 1 : (p->tokens - need) / p->frame + 1;
+  if (n > num)
+    n = num;
+  p->launch = p->tokens >= p->cost ? now :
+    now + (p->cost - p->tokens) / p->rate;
+  if (p->poisson) {
+    p->tokens -= p->cost;
+    p->cost = p->frame * rand_exp(&p->rnd);
+  } else {
+    p->tokens -= n * p->frame;
+  }
+
+  return n;
+}
+
+/* Executing thread.  Sends data to the thread's share of the
+   connections. */
+
+void *thread_data_send(void *context)
+{
+  struct worker *w = context;
+  int i, j, k, n, bnum, paced = w->pacer.frame > 0;
+  int num = w->offset + w->num;
+
+  /* log the connections */
+  SYSLOG((LOG_INFO, "Thread %d sends data (%d bytes) to %d connections\n",
+	  w->id, w->len, w->num));
+
+  if (e_rtt)
+    echo_start(w);
+
+  /* do the data sending */
+  if (e_send_loop < 0)
+    k = -2;
+  else
+    k = 0;
+
+  while(k < e_send_loop) {
+    bnum = send_batch_size(paced, k, e_send_loop);
+    for (i = w->offset; i < num; i++) {
+      for (j = 0; j < bnum; j += n) {
+	if (!e_quiet && !w->id && !e_rtt && !e_profile) {
+	  fprintf(stderr, "%5d\b\b\b\b\b", i + 1);
+	  fflush(stderr);
+	}
+
+	/* Send only what the rate allows now */
+	n = bnum - j;
+	if (!e_data_flood && paced && (n = pacer_take(w, n)) < 0)
+	  goto out;
+
+	if ((n = send_data_batch(w, i, n)) < 0 ||
+	    (!e_data_flood && send_batch_flush(w, 0) < 0)) {
+	  SYSLOG((LOG_ERR, "Thread %d: Error sending data to connection "
+		  "n:o: %d\n", w->id, i + 1));
+	  exit(1);
+	}
+
+	if (e_rtt)
+	  echo_wait(w, 0);
+
+	if (!e_data_flood && !paced) {
+	  if (e_rtt)
+	    echo_wait(w, e_sleep * 1000);
+	  else if (e_sleep * 1000 < 1000000)
+	    usleep(e_sleep * 1000);
+	  else
+	    sleep(e_sleep / 1000);
+	}
+      }
+    }
+    if (send_batch_flush(w, 0) < 0) {
+      SYSLOG((LOG_ERR, "Thread %d: Error sending data\n", w->id));
+      exit(1);
+    }
+    if (k >= 0)
+      k += bnum;
+  }
+
+ out:
+  /* Wait until all queued data is sent */
+  if (send_batch_flush(w, 1) < 0) {
+    SYSLOG((LOG_ERR, "Thread %d: Error sending data\n", w->id));
+    exit(1);
+  }
+
+  if (e_rtt)
+    echo_end(w);
+  __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+static volatile sig_atomic_t g_stop;
+
+static void client_stop(int sig)
+{
+  g_stop = 1;
+}
+
+static void client_report_line(struct hist *h, unsigned long long errors,
+			       unsigned int from, unsigned int to)
+{
+  double sec = (to - from) / 1000.0;
+
+  if (sec <= 0)
+    sec = 1;
+
+  fprintf(stderr, "[ SUM] %4u.%u-%4u.%us  %10llu  %10.1f  %8llu  %9.1f  %9.1f  %9.1f  %9.1f\n",
+	  from / 1000, from % 1000 / 100, to / 1000, to % 1000 / 100,
+	  h->count, h->count / sec, errors,
+	  hist_value(h, 0.50) / 1000.0, hist_value(h, 0.99) / 1000.0,
+	  hist_value(h, 0.999) / 1000.0, h->max / 1000.0);
+}
+
+/* Calls <report> every <msec> until the workers are done or the run is
+   interrupted, and then once more with <last> set for the whole run.
+   Returns 0 if interrupted. */
+
+static int report_loop(struct worker *workers, int num, int msec,
+		       void (*report)(void *ctx, int last), void *ctx)
+{
+  int i, k, done = 0;
+
+  signal(SIGINT, client_stop);
+  signal(SIGTERM, client_stop);
+
+  do {
+    /* Polls at least once, also when <msec> is below 10 */
+    i = 0;
+    do {
+      usleep(10000);
+      for (done = 1, k = 0; k < num; k++)
+	if (!__atomic_load_n(&workers[k].done, __ATOMIC_ACQUIRE))
+	  done = 0;
+    } while (++i < msec / 10 && !g_stop && !done);
+
+    report(ctx, 0);
+  } while (!done && !g_stop);
+
+  report(ctx, 1);
+  return done;
+}
+
+struct client_stats {
+  struct worker *workers;
+  int num;
+  struct hist *total, *prev, *ival;
+  unsigned long long start, errors, p_errors;
+  unsigned int now, p_now;
+};
+
+static void client_report_interval(void *ctx, int last)
+{
+  struct client_stats *c = ctx;
+  int k;
+
+  if (last) {
+    if (!e_quiet) {
+      fprintf(stderr, "- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -\n");
+      client_report_line(c->total, c->errors, 0, c->now);
+    }
+    return;
+  }
+
+  memset(c->total, 0, sizeof(*c->total));
+  for (c->errors = 0, k = 0; k < c->num; k++) {
+    hist_merge(c->total, c->workers[k].hist, 0);
+    c->errors += c->workers[k].stats.errors;
+  }
+  c->now = (ticks() - c->start) / e_freq;
+
+  /* Statistics of the interval */
+  if (!e_quiet) {
+    memcpy(c->ival, c->total, sizeof(*c->ival));
+    hist_merge(c->ival, c->prev, 1);
+    client_report_line(c->ival, c->errors - c->p_errors, c->p_now, c->now);
+  }
+  memcpy(c->prev, c->total, sizeof(*c->prev));
+  c->p_now = c->now;
+  c->p_errors = c->errors;
+}
+
+/* Prints the replies, <what>, and latency percentiles of the workers
+   every <msec>, and of the whole run when the workers are done or the
+   run is interrupted.  Returns 0 if interrupted. */
+
+int client_report(struct worker *workers, int num, const char *what,
+		  int msec)
+{
+  struct client_stats c;
+  int done;
+
+  memset(&c, 0, sizeof(c));
+  c.workers = workers;
+  c.num = num;
+  c.total = calloc(1, sizeof(*c.total));
+  c.prev = calloc(1, sizeof(*c.prev));
+  c.ival = calloc(1, sizeof(*c.ival));
+  if (!c.total || !c.prev || !c.ival) {
+    fprintf(stderr, "conntest: Out of memory\n");
+    exit(1);
+  }
+
+  if (!e_quiet)
+    fprintf(stderr, "\n[  ID]   Interval      %10s  %8s/s    Errors   p50 usec   p99 usec  p999 usec   max usec\n",
+	    what, what);
+
+  c.start = ticks();
+  done = report_loop(workers, num, msec, client_report_interval, &c);
+
+  free(c.total);
+  free(c.prev);
+  free(c.ival);
+  return done;
+}
+
+static void profile_report_line(unsigned long long pkts, double frame,
+				unsigned long long from, unsigned long long to)
+{
+  double sec = (to - from) / 1000000000.0;
+
+  if (sec <= 0)
+    sec = 1;
+
+  fprintf(stderr, "[ SUM] %4llu.%llu-%4llu.%llus  %13.2f  %13.2f  %10llu\n",
+	  from / 1000000000ULL, from % 1000000000ULL / 100000000ULL,
+	  to / 1000000000ULL, to % 1000000000ULL / 100000000ULL,
+	  profile_average(e_profile, from, to) / 1000000.0,
+	  pkts * frame / sec / 1000000.0, pkts);
+}
+
+struct profile_stats {
+  struct worker *workers;
+  int num;
+  double frame;
+  unsigned long long pkts, p_pkts, now, p_now;
+};
+
+static void profile_report_interval(void *ctx, int last)
+{
+  struct profile_stats *p = ctx;
+  int k;
+
+  if (last) {
+    if (!e_quiet) {
+      fprintf(stderr, "- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -\n");
+      profile_report_line(p->pkts, p->frame, 0, p->now);
+    }
+    return;
+  }
+
+  for (p->pkts = 0, k = 0; k < p->num; k++)
+    p->pkts += p->workers[k].stats.send_pkts;
+  p->now = mono_ns() - g_profile_start;
+
+  if (!e_quiet)
+    profile_report_line(p->pkts - p->p_pkts, p->frame, p->p_now, p->now);
+  p->p_pkts = p->pkts;
+  p->p_now = p->now;
+}
+
+/* Prints the -y profile's target rate against the rate sent by the
+   workers every second, and of the whole run when the workers are done
+   or the run is interrupted.  Returns 0 if interrupted. */
+
+int profile_report(struct worker *workers, int num, int len)
+{
+  struct profile_stats p;
+
+  memset(&p, 0, sizeof(p));
+  p.workers = workers;
+  p.num = num;
+  p.frame = frame_size(len);
+
+  if (!e_quiet)
+    fprintf(stderr, "\n[  ID]   Interval      Target Mbit/s    Sent Mbit/s     Packets\n");
+
+  return report_loop(workers, num, 1000, profile_report_interval, &p);
+}
+
+/******************************* HTTP client *******************************/
+
+/* Parses response status line and headers.  Returns length of the
+   header, 0 if it is not complete yet and -1 if it is malformed or the
+   body length is not known. */
+
+static int http_resp_parse(const char *buf, size_t len, int *status,
+			   unsigned long long *body)
+{
+  const char *p = buf, *end = buf + len, *eol;
+  int clen = 0;
+
+  eol = http_crlf(p, end);
+  if (!eol)
+    return 0;
+  if (eol - p < 12 || memcmp(p, "HTTP/1.", 7) || p[8] != ' ' ||
+      !isdigit(p[9]) || !isdigit(p[10]) || !isdigit(p[11]))
+    return -1;
+  *status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + p[11] - '0';
+  *body = 0;
+
+  for (;;) {
+    p = eol + 2;
+    eol = http_crlf(p, end);
+    if (!eol)
+      return 0;
+    if (eol == p)
+      break;
+
+    if (eol - p > 15 && !strncasecmp(p, "Content-Length:", 15)) {
+      for (p += 15; p < eol && (*p == ' ' || *p == '\t'); p++) ;
+      for (*body = 0; p < eol && isdigit(*p); p++)
+	*body = *body * 10 + *p - '0';
+      clen = 1;
+    } else if (eol - p > 18 && !strncasecmp(p, "Transfer-Encoding:", 18)) {
+      /* Chunked bodies are not supported */
+      return -1;
+    }
+  }
+
+  /* Body until connection close is not supported */
+  if (!clen && *status >= 200 && *status != 204 && *status != 304)
+    return -1;
+
+  return eol + 2 - buf;
+}
+
+/* Writes the pending requests.  The request buffer holds enough copies
+   of the request that any pending part is contiguous in it. */
+
+static int http_client_write(struct worker *w, struct http_conn *c, int fd,
+			     int epfd, int index)
+{
+  struct epoll_event event;
+  int ret = 0, off;
+
+  while (c->wlen) {
+    off = (w->len - c->wlen % w->len) % w->len;
+    ret = write(fd, w->data + off, c->wlen);
+    if (ret <= 0)
+      break;
+    c->wlen -= ret;
+    w->stats.send_bytes += ret;
+  }
+
+  if (ret < 0 && errno != EAGAIN && errno != EINTR)
+    return -1;
+
+  /* Poll for writable only while requests are pending */
+  if (!c->wlen == !c->pollout) {
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | (c->wlen ? EPOLLOUT : 0);
+    event.data.u32 = index;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event))
+      return -1;
+    c->pollout = !!c->wlen;
+  }
+
+  return 0;
+}
+
+/* Sends up to <num> new requests, sent at <now> */
+
+static int http_client_send(struct worker *w, struct http_conn *c, int fd,
+			    int epfd, int index, int num,
+			    unsigned long long now)
+{
+  for (; num > 0 && c->left; num--) {
+    c->sent[(c->head + c->inflight) % HTTP_PIPELINE] = now;
+    c->inflight++;
+    c->wlen += w->len;
+    if (c->left > 0)
+      c->left--;
+  }
+
+  return http_client_write(w, c, fd, epfd, index);
+}
+
+/* Response received, records its latency in nanoseconds */
+
+static void http_client_done(struct worker *w, struct http_conn *c,
+			     int status)
+{
+  hist_add(w->hist, mono_ns() - c->sent[c->head]);
+  c->head = (c->head + 1) % HTTP_PIPELINE;
+  c->inflight--;
+
+  w->stats.reqs++;
+  if (status >= 400)
+    w->stats.errors++;
+}
+
+/* Handles received response data.  Returns number of completed
+   responses or -1 on error. */
+
+static int http_client_input(struct worker *w, struct http_conn *c,
+			     const char *p, int len)
+{
+  unsigned long long body;
+  int ret, num = 0, status, n;
+
+  while (len > 0) {
+    if (c->body) {
+      n = c->body < len ? c->body : len;
+      c->body -= n;
+      p += n;
+      len -= n;
+      if (!c->body)
+	num++;
+      continue;
+    }
+
+    if (!c->inflight)
+      return -1;
+
+    if (!c->hdr) {
+      ret = http_resp_parse(p, len, &status, &body);
+      if (ret > 0) {
+	p += ret;
+	len -= ret;
+      }
+    } else {
+      /* Header continues from previous read */
+      n = HTTP_CLIENT_HDR - c->hdr_len;
+      if (n > len)
+	n = len;
+      memcpy(c->hdr + c->hdr_len, p, n);
+      ret = http_resp_parse(c->hdr, c->hdr_len + n, &status, &body);
+      if (ret > 0) {
+	p += ret - c->hdr_len;
+	len -= ret - c->hdr_len;
+	free(c->hdr);
+	c->hdr = NULL;
+      } else {
+	c->hdr_len += n;
+	p += n;
+	len -= n;
+      }
+    }
+    if (ret < 0)
+      return -1;
+
+    if (!ret) {
+      /* Keep the partial header */
+      if (!c->hdr) {
+	if (len > HTTP_CLIENT_HDR)
+	  return -1;
+	c->hdr = malloc(HTTP_CLIENT_HDR);
+	if (!c->hdr)
+	  return -1;
+	memcpy(c->hdr, p, len);
+	c->hdr_len = len;
+      } else if (c->hdr_len == HTTP_CLIENT_HDR) {
+	return -1;
+      }
+      break;
+    }
+
+    /* Latency is measured to the end of the header */
+    http_client_done(w, c, status);
+    c->body = body;
+    if (!body)
+      num++;
+  }
+
+  return num;
+}
+
+/* Sends the requests that are due by the -w open loop schedule, each on
+   the next connection with room in its pipeline.  When there is no room
+   the requests wait for responses, and their latency still runs from
+   their intended send time.  Arms the timer for the next request. */
+
+static void http_client_open(struct worker *w, int epfd, int tfd, int *next)
+{
+  struct pacer *p = &w->pacer;
+  struct itimerspec its;
+  struct http_conn *c = w->http;
+  unsigned long long now = mono_ns(), t;
+  int i = 0, k;
+
+  while (p->next <= now) {
+    for (k = 0; k < w->num; k++) {
+      i = (*next + k) % w->num;
+      c = &w->http[i];
+      if (c->left && c->inflight < e_http_depth)
+	break;
+    }
+    if (k == w->num)
+      return;
+    *next = (i + 1) % w->num;
+
+    /* Write errors show up as read errors of the connection */
+    http_client_send(w, c, w->s->sockets[w->offset + i].sock, epfd, i, 1,
+		     pacer_next(p));
+  }
+
+  t = p->next;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = t / 1000000000ULL;
+  its.it_value.tv_nsec = t % 1000000000ULL;
+  timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Executing thread.  Keeps -N requests in flight on each of the
+   thread's connections, or with -w sends them by the open loop
+   schedule. */
+
+void *thread_http_client(void *context)
+{
+  struct worker *w = context;
+  struct epoll_event event, events[64];
+  struct http_conn *c;
+  unsigned char *buf;
+  unsigned long long expired;
+  int epfd, i, n, fd, len, active = 0, ret, tfd = -1, next = 0;
+
+  buf = malloc(65536);
+  epfd = epoll_create(w->num + 1);
+  if (!buf || epfd < 0) {
+    SYSLOG((LOG_ERR, "Thread %d: %s\n", w->id, strerror(errno)));
+    exit(1);
+  }
+
+  /* Open loop timer, its index is past the connections */
+  if (w->pacer.open) {
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = w->num;
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (tfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &event)) {
+      SYSLOG((LOG_ERR, "Thread %d: %s\n", w->id, strerror(errno)));
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < w->num; i++) {
+    c = &w->http[i];
+    c->left = e_send_loop;
+    fd = w->s->sockets[w->offset + i].sock;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = i;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) ||
+	(!w->pacer.open &&
+	 http_client_send(w, c, fd, epfd, i, e_http_depth, mono_ns()) < 0)) {
+      SYSLOG((LOG_ERR, "Thread %d: %s\n", w->id, strerror(errno)));
+      exit(1);
+    }
+    active++;
+  }
+
+  while (active) {
+    if (w->pacer.open)
+      http_client_open(w, epfd, tfd, &next);
+
+    n = epoll_wait(epfd, events, 64, -1);
+    if (n < 0 && errno != EINTR) {
+      SYSLOG((LOG_ERR, "Thread %d: epoll_wait: %s\n", w->id,
+	      strerror(errno)));
+      exit(1);
+    }
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.u32 == w->num) {
+	ret = read(tfd, &expired, sizeof(expired));
+	continue;
+      }
+
+      c = &w->http[events[i].data.u32];
+      fd = w->s->sockets[w->offset + events[i].data.u32].sock;
+      ret = 0;
+
+      if (events[i].events & EPOLLOUT)
+	ret = http_client_write(w, c, fd, epfd, events[i].data.u32);
+
+      while (!ret && (len = read(fd, buf, 65536)) > 0) {
+	w->stats.recv_bytes += len;
+	ret = http_client_input(w, c, (char *)buf, len);
+	if (ret > 0)
+	  ret = w->pacer.open ? 0 :
+	    http_client_send(w, c, fd, epfd, events[i].data.u32, ret,
+			     mono_ns());
+	if (!c->left && !c->inflight)
+	  break;
+      }
+      if (!ret && !len)
+	ret = -1;
+      else if (!ret && len < 0 && errno != EAGAIN && errno != EINTR)
+	ret = -1;
+
+      if (ret < 0 || (!c->left && !c->inflight)) {
+	/* Done, or the connection failed with requests left */
+	if (ret < 0 && (c->left || c->inflight)) {
+	  w->stats.errors++;
+	  SYSLOG((LOG_ERR, "Thread %d: connection n:o %d failed\n",
+		  w->id, w->offset + events[i].data.u32 + 1));
+	}
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &event);
+	c->left = c->inflight = 0;
+	active--;
+      }
+    }
+  }
+
+  if (tfd >= 0)
+    close(tfd);
+  close(epfd);
+  free(buf);
+  __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* HTTP load generator.  Prints the requests and latency percentiles of
+   every -n interval and of the whole run. */
+
+void http_client(struct sockets *s)
+{
+  struct worker *workers, *w;
+  int i, k, num, len;
+  char req[1024];
+
+  freq_init();
+
+  len = snprintf(req, sizeof(req), "GET %.*s HTTP/1.1\r\nHost: %s\r\n\r\n",
+		 e_header ? e_header_len : 1, e_header ? e_header : "/",
+		 e_host ? e_host : e_ip_start);
+  if (len >= sizeof(req)) {
+    fprintf(stderr, "conntest: URI is too long\n");
+    exit(1);
+  }
+
+  workers = workers_alloc(e_threads);
+  if (!workers) {
+    fprintf(stderr, "conntest: Out of memory\n");
+    exit(1);
+  }
+
+  num = s->num_sockets / e_threads;
+  for (i = 0; i < e_threads; i++) {
+    w = &workers[i];
+    w->id = i;
+    w->s = s;
+    w->offset = i * num;
+    w->num = i == e_threads - 1 ? s->num_sockets - w->offset : num;
+    pacer_init(&w->pacer, len, (double)w->num / s->num_sockets, i);
+
+    /* Request copied so that any partial write is contiguous */
+    w->len = len;
+    w->data = malloc(len * (e_http_depth + 1));
+    w->hist = calloc(1, sizeof(*w->hist));
+    w->http = calloc(w->num, sizeof(*w->http));
+    if (!w->data || !w->hist || !w->http) {
+      fprintf(stderr, "conntest: Out of memory\n");
+      exit(1);
+    }
+    for (k = 0; k <= e_http_depth; k++)
+      memcpy(w->data + k * len, req, len);
+  }
+
+  for (i = 0; i < e_threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, thread_http_client,
+		       &workers[i])) {
+      fprintf(stderr, "pthread_create(): %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+
+  if (!client_report(workers, e_threads, "Reqs", e_sleep))
+    return;
+
+  for (i = 0; i < e_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    free(workers[i].data);
+    free(workers[i].hist);
+    free(workers[i].http);
+  }
+  free(workers);
+}
+
+/******************************* Server mode *******************************/
+
+void *thread_server(void *context);
+void server_report(struct worker *workers, int num);
+
+/* Returns the number of socket table slots each thread handles when
+   there are <listeners> server sockets per thread. */
+
+static int server_shard_size(int listeners)
+{
+  int num;
+
+  if (e_proto != SOCK_STREAM)
+    return listeners;
+
+  /* With TCP the accepted connections take the rest of the slots */
+  num = e_num_conn / e_threads;
+  if (e_reuseport && num <= listeners) {
+    fprintf(stderr, "conntest: too many threads (not enough connections)\n");
+    exit(1);
+  }
+
+  return num;
+}
+
+void server(void)
+{
+  int l, k, i, count, listeners;
+  struct sockets s;
+  struct worker *workers, *w;
+  int num, shards, t;
+
+  memset(&s, 0, sizeof(s));
+
+  freq_init();
+
+  g_hash_key = rdtsc() ^ (unsigned long long)getpid() << 32;
+
+  if (e_filename)
+    e_output = fopen(e_filename, "w+");
+  if (!e_output)
+    e_output = stderr;
+
+  if (e_server_mode == SERVER_HTTP && mime_init(e_mime_types) < 0) {
+    fprintf(stderr, "conntest: %s: %s\n", e_mime_types, strerror(errno));
+    exit(1);
+  }
+
+  /* For now local port range support not enabled */
+  e_lport_end = e_lport;
+
+  /* For TCP we must reserve space for incoming connections.  For UDP
+     e_num_conn works are maximum limit. */
+  if (e_num_conn == 1)
+#if defined(MAX_SOCKETS)
+    e_num_conn = MAX_SOCKETS;
+#else
+    e_num_conn = MAX_CONNS;
+#endif /* MAX_SOCKETS */
+
+  /* With -W every thread creates its own listeners, which are placed
+     at the start of the thread's share of the socket table. */
+  shards = e_reuseport ? e_threads : 1;
+
+  if (e_lip_start && e_lip_end) {
+    int start, end;
+    char *scope = NULL;
+
+    if (!e_force_ip4 && is_ip6(e_lip_start))
+      e_want_ip6 = 1;
+
+    if (e_want_ip6) {
+      if (strchr(e_lip_start, '%')) {
+        scope = strdup(strchr(e_lip_start, '%'));
+        *strchr(e_lip_start, '%') = '\0';
+        if (strchr(e_lip_end, '%'))
+          *strchr(e_lip_end, '%') = '\0';
+      }
+      start = strtol(strrchr(e_lip_start, ':') + 1, (char **)NULL, 16);
+      end = strtol(strrchr(e_lip_end, ':') + 1, (char **)NULL, 16);
+    } else {
+      start = atoi(strrchr(e_lip_start, '.') + 1);
+      end = atoi(strrchr(e_lip_end, '.') + 1);
+    }
+
+    listeners = 0;
+    for (k = start; k <= end; k++)
+      for (l = e_lport; l <= e_lport_end; l++)
+        listeners++;
+    num = server_shard_size(listeners);
+
+#ifndef MAX_SOCKETS
+    /* Allocate sockets */
+    sockets_alloc(&s, e_num_conn + listeners * shards);
+#endif /* !MAX_SOCKETS */
+
+    for (t = 0; t < shards; t++) {
+      count = 0;
+      for (k = start; k <= end; k++) {
+	/* create sockets */
+	char tmp[128], ip[128];
+
+	memset(ip, 0, sizeof(ip));
+	memcpy(tmp, e_lip_start, strlen(e_lip_start));
+	if (e_want_ip6) {
+	  *strrchr(tmp, ':') = '\0';
+	  snprintf(ip, sizeof(ip) - 1, "%s:%x%s", tmp, k, scope ? scope : "");
+	} else {
+	  *strrchr(tmp, '.') = '\0';
+	  snprintf(ip, sizeof(ip) - 1, "%s.%d", tmp, k);
+	}
+
+	for (l = e_lport; l <= e_lport_end; l++) {
+	  if (create_server(l, ip, t * num + count, &s, e_port, e_host) < 0)
+	    exit(1);
+
+	  if (!e_flood)
+	    usleep(50000);
+	  count++;
+	}
+      }
+    }
+  } else {
+    listeners = 0;
+    for (l = e_lport; l <= e_lport_end; l++)
+      listeners++;
+    num = server_shard_size(listeners);
+
+#ifndef MAX_SOCKETS
+    /* Allocate sockets */
+    sockets_alloc(&s, e_num_conn + listeners * shards);
+#endif /* !MAX_SOCKETS */
+
+    if (!e_force_ip4 && is_ip6(e_lip))
+      e_want_ip6 = 1;
+
+    /* create the sockets */
+    for (t = 0; t < shards; t++) {
+      count = 0;
+      for (l = e_lport; l <= e_lport_end; l++) {
+	if (create_server(l, e_lip, t * num + count, &s, e_port, e_host) < 0)
+	  exit(1);
+
+	if (!e_flood)
+	  usleep(50000);
+	count++;
+      }
+    }
+  }
+  i = listeners * shards;
+
+  if (e_proto == SOCK_STREAM) {
+    s.num_sockets = e_num_conn;
+    sockets_free_init(&s);
+  } else {
+    s.num_sockets = i;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!e_quiet)
+    fprintf(stderr,
+"------------------------------------------------------------------------------\n");
+
+  workers = workers_alloc(e_threads);
+  if (!workers) {
+    fprintf(stderr, "conntest: Out of memory\n");
+    exit(1);
+  }
+
+  /* Generate threads for sockets, spread evenly, the last one takes the
+     rest */
+  num = s.num_sockets / e_threads;
+  for (i = 0; i < e_threads; i++) {
+    w = &workers[i];
+    w->id = i;
+    w->s = &s;
+    w->offset = i * num;
+    w->num = i == e_threads - 1 ? s.num_sockets - w->offset : num;
+    w->time = e_time * (i + 1);
+    w->last_active = ticks();
+
+    if (pthread_create(&w->thread, NULL, thread_server, w)) {
+      fprintf(stderr, "pthread_create(): %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+
+  /* Main thread reports statistics */
+  server_report(workers, e_threads);
+}
+
+static inline
+unsigned long long hash_mix(unsigned long long hash, unsigned long long val)
+{
+  hash ^= val;
+  hash *= 0x9e3779b97f4a7c15ULL;
+  return hash ^ (hash >> 32);
+}
+
+/* Keyed hash of the remote address.  The key is random per run so that
+   spoofed sources cannot be chosen to collide. */
+
+static
+unsigned int hash_conn(c_sockaddr *remote)
+{
+  unsigned long long hash = g_hash_key;
+
+  if (e_want_ip6) {
+    hash = hash_mix(hash, remote->sin6.sin6_port);
+    hash = hash_mix(hash, (unsigned long long)
+		    remote->sin6.sin6_addr.s6_addr32[0] << 32 |
+		    remote->sin6.sin6_addr.s6_addr32[1]);
+    hash = hash_mix(hash, (unsigned long long)
+		    remote->sin6.sin6_addr.s6_addr32[2] << 32 |
+		    remote->sin6.sin6_addr.s6_addr32[3]);
+  } else {
+    hash = hash_mix(hash, (unsigned long long)
+		    remote->sin.sin_addr.s_addr << 16 |
+		    remote->sin.sin_port);
+  }
+
+  /* Finalize so that all input bits affect the table index */
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+
+  return (unsigned int)hash;
+}
+
+static
+int cmp_conn(c_sockaddr *a1, c_sockaddr *a2)
+{
+  return memcmp(a1, a2, sizeof(*a2));
+}
+
+/* Returns the IP address of <addr> as string.  Addresses are formatted
+   only when printed, and the last one is cached per thread since the
+   same connection is usually printed several times in a row.  The
+   string is valid until the next call. */
+
+static const char *addr_ip(c_sockaddr *addr)
+{
+  static __thread c_sockaddr last;
+  static __thread char ip[INET6_ADDRSTRLEN];
+
+  if (ip[0] && !cmp_conn(&last, addr))
+    return ip;
+
+  last = *addr;
+  if (addr->sa.sa_family == AF_INET6)
+    inet_ntop(AF_INET6, &addr->sin6.sin6_addr, ip, sizeof(ip));
+  else
+    inet_ntop(AF_INET, &addr->sin.sin_addr, ip, sizeof(ip));
+
+  return ip;
+}
+
+static inline int addr_port(c_sockaddr *addr)
+{
+  return ntohs(addr->sa.sa_family == AF_INET6 ? addr->sin6.sin6_port :
+	       addr->sin.sin_port);
+}
+
+/* UDP connections of a server socket are in open addressing hash table
+   with linear probing.  The table is doubled when it is 70% full. */
+
+static
+struct socket_conn *find_conn(struct sockets *s, c_sockaddr *remote,
+			      struct socket *sock)
+{
+  struct socket_conn *conn;
+  unsigned int hash, i, mask;
+
+  if (!sock->num_conns)
+    return NULL;
+
+  hash = hash_conn(remote);
+  mask = sock->conns_size - 1;
+  for (i = hash & mask; (conn = sock->conns[i]); i = (i + 1) & mask)
+    if (conn->hash == hash && !cmp_conn(&conn->addr, remote))
+      break;
+
+  return conn;
+}
+
+static void insert_conn(struct socket_conn **conns, unsigned int size,
+			struct socket_conn *conn)
+{
+  unsigned int i;
 
-      memset(ip, 0, sizeof(ip));
-      memcpy(tmp, e_lip_start, strlen(e_lip_start));
-      if (e_want_ip6) {
-        *strrchr(tmp, ':') = '\0';
-        snprintf(ip, sizeof(ip) - 1, "%s:%x%s", tmp, k, scope ? scope : "");
-      } else {
-        *strrchr(tmp, '.') = '\0';
-        snprintf(ip, sizeof(ip) - 1, "%s.%d", tmp, k);
-      }
+  for (i = conn->hash & (size - 1); conns[i]; i = (i + 1) & (size - 1));
+  conns[i] = conn;
+}
 
-      for (l = e_lport; l <= e_lport_end; l++) {
-	if (create_server(l, ip, count, &s, e_port, e_host) < 0)
-	  exit(1);
+/* Adds UDP connection to the hash table of <sock>.  Returns -1 if out of
+   memory. */
 
-	if (!e_flood)
-	  usleep(50000);
-	count++;
-      }
-    }
-    i = count;
-  } else {
-#ifndef MAX_SOCKETS
-    /* Allocate sockets */
-    for (l = e_port; l <= e_port_end; l++)
-      count++;
-    sockets_alloc(&s, e_num_conn + count);
-#endif /* !MAX_SOCKETS */
-    count = 0;
+static int put_conn(struct socket *sock, struct socket_conn *conn)
+{
+  struct socket_conn **conns;
+  unsigned int i, size;
 
-    if (!e_force_ip4 && is_ip6(e_lip))
-      e_want_ip6 = 1;
+  if ((sock->num_conns + 1) * 10 > sock->conns_size * 7) {
+    size = sock->conns_size ? sock->conns_size * 2 : CONN_HASH_SIZE;
+    conns = calloc(size, sizeof(*conns));
+    if (!conns)
+      return -1;
 
-    /* create the sockets */
-    for (l = e_lport; l <= e_lport_end; l++) {
-      if (create_server(l, e_lip, count, &s, e_port, e_host) < 0)
-	exit(1);
+    for (i = 0; i < sock->conns_size; i++)
+      if (sock->conns[i])
+	insert_conn(conns, size, sock->conns[i]);
 
-      if (!e_flood)
-	usleep(50000);
-       count++;
-    }
-    i = count;
+    free(sock->conns);
+    sock->conns = conns;
+    sock->conns_size = size;
   }
 
-  if (e_proto == SOCK_STREAM)
-    s.num_sockets = e_num_conn;
-  else
-    s.num_sockets = i;
+  insert_conn(sock->conns, sock->conns_size, conn);
+  sock->num_conns++;
 
-  /* Generate threads for sockets, spread evenly */
-  offset = 0;
-  num = s.num_sockets / e_threads;
-  for (i = 0; i < e_threads; i++) {
-    if (i)
-      offset += num;
+  return 0;
+}
 
-    if (i == e_threads - 1)
-      break;
+/* Removes UDP connection from the hash table of <sock>.  The following
+   entries are moved backwards so that no probe chain is broken. */
+
+static void del_conn(struct socket *sock, struct socket_conn *conn)
+{
+  unsigned int i, j, k, mask = sock->conns_size - 1;
+
+  for (i = conn->hash & mask; sock->conns[i] != conn; i = (i + 1) & mask);
+  sock->conns[i] = NULL;
+  sock->num_conns--;
 
-    if (fork())
+  for (j = (i + 1) & mask; sock->conns[j]; j = (j + 1) & mask) {
+    /* Entry stays if its home slot is cyclically in (i, j] */
+    k = sock->conns[j]->hash & mask;
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
       continue;
 
-    /* thread calls */
-    thread_server(&s, offset, num);
+    sock->conns[i] = sock->conns[j];
+    sock->conns[j] = NULL;
+    i = j;
   }
+}
+
+struct timer_wheel *timer_wheel_alloc(void)
+{
+  struct timer_wheel *tw;
+  int i, j;
+
+  tw = calloc(1, sizeof(*tw));
+  if (!tw)
+    return NULL;
+
+  for (i = 0; i < WHEEL_LEVELS; i++)
+    for (j = 0; j < WHEEL_SIZE; j++)
+      tw->slots[i][j].next = tw->slots[i][j].prev = &tw->slots[i][j];
 
-  /* Main thread handles rest */
-  thread_server(&s, offset, num);
+  return tw;
 }
 
-static
-unsigned int hash_conn(c_sockaddr *remote)
+static void timer_link(struct timer *head, struct timer *t)
 {
-  unsigned int hash = 0;
+  t->next = head->next;
+  t->prev = head;
+  head->next->prev = t;
+  head->next = t;
+}
 
-  if (e_want_ip6) {
-    hash ^= remote->sin6.sin6_port;
-    hash ^= remote->sin6.sin6_addr.s6_addr32[0];
-    hash ^= remote->sin6.sin6_addr.s6_addr32[1];
-    hash ^= remote->sin6.sin6_addr.s6_addr32[2];
-    hash ^= remote->sin6.sin6_addr.s6_addr32[3];
-  } else {
-    hash ^= remote->sin.sin_port;
-    hash ^= remote->sin.sin_addr.s_addr;
-  }
+static void timer_del(struct timer *t)
+{
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+static void timer_place(struct timer_wheel *tw, struct timer *t)
+{
+  unsigned long long delta = t->expires - tw->now;
+  int level;
 
-  return hash & (CONN_HASH_SIZE - 1);
+  for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    if (!(delta >> (WHEEL_BITS * (level + 1))))
+      break;
+
+  timer_link(&tw->slots[level][(t->expires >> (WHEEL_BITS * level)) &
+			       (WHEEL_SIZE - 1)], t);
 }
 
-static
-int cmp_conn(c_sockaddr *a1, c_sockaddr *a2)
+/* Schedules timer <t> to expire on tick <expires>, at the earliest on
+   the next tick. */
+
+static void timer_add(struct timer_wheel *tw, struct timer *t,
+		      unsigned long long expires)
 {
-  return memcmp(a1, a2, sizeof(*a2));
+  unsigned long long max = (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+  if (expires <= tw->now)
+    expires = tw->now + 1;
+  if (expires - tw->now > max)
+    expires = tw->now + max;
+  t->expires = expires;
+
+  timer_place(tw, t);
+}
+
+/* Advances the wheel by one tick and moves the timers that expire on it
+   to the <due> list. */
+
+static void timer_tick(struct timer_wheel *tw, struct timer *due)
+{
+  struct timer *head, *t;
+  int level;
+
+  tw->now++;
+
+  /* Move timers down when the lower levels wrap around */
+  for (level = 1; level < WHEEL_LEVELS; level++) {
+    if (tw->now & ((1ULL << (WHEEL_BITS * level)) - 1))
+      break;
+    head = &tw->slots[level][(tw->now >> (WHEEL_BITS * level)) &
+			     (WHEEL_SIZE - 1)];
+    while ((t = head->next) != head) {
+      timer_del(t);
+      timer_place(tw, t);
+    }
+  }
+
+  due->next = due->prev = due;
+  head = &tw->slots[0][tw->now & (WHEEL_SIZE - 1)];
+  if (head->next != head) {
+    due->next = head->next;
+    due->prev = head->prev;
+    due->next->prev = due;
+    due->prev->next = due;
+    head->next = head->prev = head;
+  }
 }
 
 static double scale_bytes(double val, const char **ret_unit)
@@ -2538,6 +5347,44 @@ static void print_gstats(int end)
   g_p_send_pkts = g_send_pkts;
 }
 
+/* Reports the statistics of all threads every -n interval, and exits when
+   all threads have been idle -l seconds. */
+
+void server_report(struct worker *workers, int num)
+{
+  unsigned long long last_active;
+  int i;
+
+  while (1) {
+    if (e_sleep * 1000 < 1000000)
+      usleep(e_sleep * 1000);
+    else
+      sleep(e_sleep / 1000);
+
+    g_recv_pkts = g_send_pkts = 0;
+    g_recv_bytes = g_send_bytes = 0;
+    g_conns = 0;
+    last_active = 0;
+    for (i = 0; i < num; i++) {
+      g_recv_pkts += workers[i].stats.recv_pkts;
+      g_send_pkts += workers[i].stats.send_pkts;
+      g_recv_bytes += workers[i].stats.recv_bytes;
+      g_send_bytes += workers[i].stats.send_bytes;
+      g_conns += workers[i].stats.conns;
+      if (workers[i].last_active > last_active)
+	last_active = workers[i].last_active;
+    }
+
+    print_gstats(1);
+
+    if (e_exit_limit &&
+	(ticks() - last_active) / e_freq >= e_exit_limit * 1000) {
+      SYSLOG((LOG_INFO, "PID %d exiting, idle limit reached", getpid()));
+      exit(1);
+    }
+  }
+}
+
 static void print_conn(struct socket_conn *conn, struct socket *sock, int end)
 {
   const char *unit;
@@ -2559,11 +5406,13 @@ static void print_conn(struct socket_conn *conn, struct socket *sock, int end)
   conn->p_time = conn->time;
 
   sec = e_sleep / 1000;
+  if (end)
+    sec = conn->time / 1000;
   if (!sec)
     sec = 1;
 
-  if (end)
-    sec = conn->time / 1000;
+  /* Keep the lines of different threads apart */
+  flockfile(e_output);
 
   if (e_csv) {
     /* CSV output */
@@ -2583,7 +5432,8 @@ static void print_conn(struct socket_conn *conn, struct socket *sock, int end)
     else
       fprintf(e_output, "%lx,", (unsigned long)conn);
 
-    fprintf(e_output, "%s,%d,", conn->ip, conn->port);
+    fprintf(e_output, "%s,%d,", addr_ip(&conn->addr),
+	    addr_port(&conn->addr));
 
     if (!end)
       fprintf(e_output, "%u.%u-%u.%u,",
@@ -2741,144 +5591,436 @@ static void print_conn(struct socket_conn *conn, struct socket *sock, int end)
 
  out:
   fflush(e_output);
+  funlockfile(e_output);
   conn->p_recv_bytes = conn->recv_bytes;
   conn->p_recv_pkts = conn->recv_pkts;
   conn->p_send_bytes = conn->send_bytes;
   conn->p_send_pkts = conn->send_pkts;
 }
 
+static unsigned int mime_hash(const char *ext, size_t len)
+{
+  unsigned int hash = 2166136261U;
+
+  while (len--)
+    hash = (hash ^ tolower((unsigned char)*ext++)) * 16777619U;
+
+  return hash & (MIME_HASH_SIZE - 1);
+}
+
+/* Adds extension, a later one replaces earlier same extension.  Returns
+   -1 if the extension or the type is too long. */
+
+static int mime_add(const char *ext, size_t len, const char *type)
+{
+  struct mime_type *m;
+  size_t i;
+
+  if (!len || len >= MIME_EXT_MAX || strlen(type) >= MIME_TYPE_MAX)
+    return -1;
+
+  m = calloc(1, sizeof(*m));
+  if (!m) {
+    SYSLOG((LOG_ERR, "Out of memory"));
+    exit(1);
+  }
+  for (i = 0; i < len; i++)
+    m->ext[i] = tolower((unsigned char)ext[i]);
+  m->type = type;
+  m->next = mime_table[mime_hash(ext, len)];
+  mime_table[mime_hash(ext, len)] = m;
+  return 0;
+}
+
+/* Initializes the MIME types with the built-in types and then the types
+   from mime.types style <filename>, if given.  Returns -1 if the file
+   cannot be read. */
+
+int mime_init(const char *filename)
+{
+  char line[1024], *type, *ext;
+  FILE *f;
+  int i, used;
+
+  for (i = 0; i < sizeof(mime_builtin) / sizeof(mime_builtin[0]); i++)
+    mime_add(mime_builtin[i][0], strlen(mime_builtin[i][0]),
+	     mime_builtin[i][1]);
+
+  if (!filename)
+    return 0;
+
+  f = fopen(filename, "r");
+  if (!f)
+    return -1;
+
+  /* Lines are "type ext1 ext2 ...", # starts comment */
+  while (fgets(line, sizeof(line), f)) {
+    if (strchr(line, '#'))
+      *strchr(line, '#') = '\0';
+    type = strtok(line, " \t\r\n");
+    if (!type || strlen(type) >= MIME_TYPE_MAX)
+      continue;
+    /* Types without extensions are not needed */
+    ext = strtok(NULL, " \t\r\n");
+    if (!ext)
+      continue;
+    type = strdup(type);
+    if (!type) {
+      SYSLOG((LOG_ERR, "Out of memory"));
+      exit(1);
+    }
+    used = 0;
+    do
+      used |= !mime_add(ext, strlen(ext), type);
+    while ((ext = strtok(NULL, " \t\r\n")));
+    if (!used)
+      free(type);
+  }
+
+  fclose(f);
+  return 0;
+}
+
+/* Returns the MIME type of <path> by its extension, or NULL */
+
+static const char *mime_lookup(const char *path)
+{
+  const char *ext, *name;
+  struct mime_type *m;
+  size_t len, i;
+
+  name = strrchr(path, '/');
+  ext = strrchr(name ? name : path, '.');
+  if (!ext)
+    return NULL;
+  ext++;
+  len = strlen(ext);
+  if (!len || len >= MIME_EXT_MAX)
+    return NULL;
+
+  for (m = mime_table[mime_hash(ext, len)]; m; m = m->next) {
+    for (i = 0; i < len; i++)
+      if (m->ext[i] != tolower((unsigned char)ext[i]))
+	break;
+    if (i == len && !m->ext[len])
+      return m->type;
+  }
+
+  return NULL;
+}
+
+/* Releases reference to the file, and the file itself when it is no
+   longer in the cache */
+
+static void http_file_put(struct http_file *f)
+{
+  if (--f->refs || f->cached)
+    return;
+
+  if (f->data)
+    munmap(f->data, f->size);
+  close(f->fd);
+  free(f->path);
+  free(f);
+}
+
+static void http_cache_del(struct http_cache *cache, struct http_file *f)
+{
+  struct http_file **p;
+
+  for (p = &cache->table[f->hash & (HTTP_CACHE_SIZE - 1)]; *p;
+       p = &(*p)->next) {
+    if (*p == f) {
+      *p = f->next;
+      break;
+    }
+  }
+  cache->num--;
+  f->cached = 0;
+  f->refs++;
+  http_file_put(f);
+}
+
+/* Renders the response headers of the file.  Returns -1 if they do not
+   fit in the header buffer. */
+
+static int http_file_header(struct http_file *f)
+{
+  const char *type = mime_lookup(f->path);
+  int i, len;
+
+  for (i = 0; i < 2; i++) {
+    len = snprintf(f->hdr[i], HTTP_HEADER_MAX, "%s"
+		   "Content-Length: %llu\r\n"
+		   "%s%s%s%s\r\n",
+		   HTTP_HEADER, (unsigned long long)f->size,
+		   type ? "Content-Type: " : "",
+		   type ? type : "", type ? "\r\n" : "",
+		   i ? "Connection: keep-alive\r\n"
+		   "Keep-alive: 60\r\n" : "");
+    if (len < 0 || len >= HTTP_HEADER_MAX)
+      return -1;
+    f->hdr_len[i] = len;
+  }
+
+  return 0;
+}
+
+/* Returns the file of <path> with a reference, or NULL if it is not a
+   regular file.  Cached files are checked with stat() at most once per
+   -z interval, and opened again if they have changed. */
+
+static struct http_file *http_cache_get(struct http_cache *cache,
+					const char *path)
+{
+  unsigned long long hash = g_hash_key, now;
+  struct http_file *f;
+  struct stat st;
+  const char *c;
+  int fd;
+
+  for (c = path; *c; c++)
+    hash = hash_mix(hash, (unsigned char)*c);
+
+  for (f = cache->table[hash & (HTTP_CACHE_SIZE - 1)]; f; f = f->next)
+    if (f->hash == hash && !strcmp(f->path, path))
+      break;
+
+  now = ticks() / e_freq;
+  if (f && now - f->checked < e_http_check) {
+    f->refs++;
+    return f;
+  }
+
+  if (f) {
+    if (!stat(path, &st) && st.st_mtime == f->mtime &&
+	st.st_size == f->size && st.st_ino == f->ino) {
+      f->checked = now;
+      f->refs++;
+      return f;
+    }
+    http_cache_del(cache, f);
+  }
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
+  }
+
+  f = calloc(1, sizeof(*f));
+  if (!f || !(f->path = strdup(path))) {
+    SYSLOG((LOG_ERR, "Out of memory"));
+    exit(1);
+  }
+  f->hash = hash;
+  f->fd = fd;
+  f->refs = 1;
+  f->size = st.st_size;
+  f->mtime = st.st_mtime;
+  f->ino = st.st_ino;
+  f->checked = now;
+
+  /* Small files are mapped, so that they can be batched in one write
+     with the headers */
+  if (f->size > 0 && f->size <= HTTP_MAP_MAX) {
+    f->data = mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (f->data == MAP_FAILED)
+      f->data = NULL;
+  }
+  if (http_file_header(f) < 0) {
+    SYSLOG((LOG_ERR, "%s: Response header too long\n", path));
+    if (f->data)
+      munmap(f->data, f->size);
+    close(fd);
+    free(f->path);
+    free(f);
+    return NULL;
+  }
+
+  /* When the cache is full the file is used for this response only */
+  if (cache->num < HTTP_CACHE_MAX) {
+    f->next = cache->table[hash & (HTTP_CACHE_SIZE - 1)];
+    cache->table[hash & (HTTP_CACHE_SIZE - 1)] = f;
+    cache->num++;
+    f->cached = 1;
+  }
+
+  return f;
+}
+
+static struct socket_conn *conn_alloc(struct worker *w)
+{
+  struct socket_conn *conn;
+
+  conn = pool_get(&w->conn_pool);
+  if (conn)
+    memset(conn, 0, sizeof(*conn));
+
+  return conn;
+}
+
+/* Gives the buffer of connection back to the pool */
+
+static void conn_buf_put(struct worker *w, struct socket_conn *conn)
+{
+  if (conn->bufp) {
+    buf_put(w->buf_pool, conn->bufp);
+    conn->bufp = NULL;
+  } else if (conn->buf) {
+    buf_put(w->buf_pool, conn->buf);
+  }
+  conn->buf = NULL;
+}
+
+static void conn_free(struct worker *w, struct socket_conn *conn)
+{
+  int i;
+
+  if (conn->resp) {
+    for (i = 0; i < conn->resp_num; i++)
+      if (conn->resp[conn->resp_head + i].file)
+	http_file_put(conn->resp[conn->resp_head + i].file);
+    buf_put(w->buf_pool, (unsigned char *)conn->resp);
+  }
+  conn_buf_put(w, conn);
+  pool_put(&w->conn_pool, conn);
+}
+
 static
-void close_conn(struct socket *sock, struct socket_conn *conn, int epfd, int err)
+void close_conn(struct worker *w, struct socket *sock, struct socket_conn *conn,
+		int err)
 {
   struct epoll_event event;
-  unsigned int hash;
 
   if (e_proto == SOCK_STREAM) {
     /* TCP */
     memset(&event, 0, sizeof(event));
-    epoll_ctl(epfd, EPOLL_CTL_DEL, sock->sock, &event);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, sock->sock, &event);
 
-    if (!e_quiet && e_threads == 1) {
+    if (!e_quiet) {
       print_conn(conn, sock, 1);
       if (!e_csv) {
         if (err < 0)
 	  fprintf(e_output, "[%4x] Closing TCP connection from %s:%d: %s\n",
-		  sock->sock, conn->ip, conn->port, strerror(errno));
+		  sock->sock, addr_ip(&conn->addr), addr_port(&conn->addr),
+		  strerror(errno));
         else
 	  fprintf(e_output, "[%4x] Closing TCP connection from %s:%d\n",
-		  sock->sock, conn->ip, conn->port);
+		  sock->sock, addr_ip(&conn->addr), addr_port(&conn->addr));
       }
     }
 
-    free(conn->buf);
+    conn_free(w, conn);
     close(sock->sock);
     sock->sock = 0;
-    free(sock->conn);
     sock->conn = NULL;
+    sockets_put_slot(w->s, sock - w->s->sockets);
   } else {
     /* UDP */
-    if (conn->prev) {
-      conn->prev->next = conn->next;
-    } else {
-      hash = hash_conn(&conn->addr);
-      sock->conns[hash] = conn->next;
-    }
+    del_conn(sock, conn);
+    if (conn->timer.next)
+      timer_del(&conn->timer);
 
-    if (conn->next)
-      conn->next->prev = conn->prev;
-
-    if (!e_quiet && e_threads == 1) {
+    if (!e_quiet) {
       print_conn(conn, sock, 1);
       if (!e_csv) {
         if (err < 0)
           fprintf(e_output, "[%lx] Expire UDP connection from %s:%d: %s\n",
-		  (unsigned long)conn, conn->ip, conn->port,
-		  strerror(errno));
+		  (unsigned long)conn, addr_ip(&conn->addr),
+		  addr_port(&conn->addr), strerror(errno));
         else
           fprintf(e_output, "[%lx] Expire UDP connection from %s:%d\n",
-		  (unsigned long)conn, conn->ip, conn->port);
+		  (unsigned long)conn, addr_ip(&conn->addr),
+		  addr_port(&conn->addr));
       }
     }
 
-    e_num_conn++;
-    g_conns--;
+    __sync_add_and_fetch(&e_num_conn, 1);
+    w->stats.conns--;
 
-    free(conn->buf);
-    free(conn->ip);
-    free(conn);
+    conn_free(w, conn);
   }
 }
 
-static void check_conn(struct socket *sock)
+static void check_conn(struct worker *w, struct socket *sock)
 {
-  struct socket_conn *conn, *next;
-  int i;
-
-  if (e_proto == SOCK_STREAM) {
-    /* TCP */
-    conn = sock->conn;
-    if (!conn)
-      return;
-    conn->time += e_sleep;
-
-    print_conn(conn, sock, 0);
-    return;
-  }
+  struct socket_conn *conn;
 
-  /* UDP */
-  if (!sock->conns)
+  /* TCP */
+  conn = sock->conn;
+  if (!conn)
     return;
-  for (i = 0; i < CONN_HASH_SIZE; i++)
-    for (conn = sock->conns[i]; conn; conn = next) {
-      next = conn->next;
+  conn->time += e_sleep;
 
-      /* Check for expiry */
-      if (conn->time - conn->p_time >= EXPIRE_UDP) {
-	close_conn(sock, conn, -1, 0);
-	continue;
-      }
+  print_conn(conn, sock, 0);
+}
 
-      conn->time += e_sleep;
+/* Returns the number of ticks after which idle UDP connection expires */
 
-      /* Print stats */
-      print_conn(conn, sock, 0);
-    }
+static inline unsigned long long expire_ticks(void)
+{
+  return (EXPIRE_UDP + e_sleep - 1) / e_sleep;
 }
 
-static
-struct socket_conn *find_conn(struct sockets *s, c_sockaddr *remote,
-			      struct socket *sock)
+/* Runs the UDP connection timers that are due on this tick.  Active
+   connection reports its statistics on every tick, and idle connection
+   is checked again when it would expire.  With -G nothing is reported,
+   and the activity is checked only once per expiry time. */
+
+static void expire_conns(struct worker *w)
 {
+  struct timer_wheel *tw = w->wheel;
+  struct timer due, *t;
   struct socket_conn *conn;
-  unsigned int hash;
 
-  if (!sock->conns)
-    return NULL;
+  timer_tick(tw, &due);
+  while ((t = due.next) != &due) {
+    timer_del(t);
+    conn = (struct socket_conn *)((char *)t -
+				  offsetof(struct socket_conn, timer));
+    conn->time = (tw->now - conn->start) * e_sleep;
+
+    if (conn->recv_pkts != conn->t_pkts) {
+      /* Active, print stats */
+      conn->t_pkts = conn->recv_pkts;
+      conn->active = tw->now;
+      print_conn(conn, conn->sock, 0);
+      timer_add(tw, t, e_gstats ? tw->now + expire_ticks() : tw->now + 1);
+      continue;
+    }
 
-  hash = hash_conn(remote);
-  for (conn = sock->conns[hash]; conn; conn = conn->next)
-    if (!cmp_conn(&conn->addr, remote))
-      break;
+    /* Check for expiry */
+    if (tw->now - conn->active >= expire_ticks()) {
+      close_conn(w, conn->sock, conn, 0);
+      continue;
+    }
 
-  return conn;
+    timer_add(tw, t, conn->active + expire_ticks());
+  }
 }
 
-static
-struct socket_conn *add_conn(struct sockets *s, int sock, c_sockaddr *remote,
-			     int epfd, struct socket *s_sock)
-{
-  struct socket_conn *conn = NULL;
-  struct epoll_event event;
-  char ip[NI_MAXHOST];
-  unsigned int j, port, hash;
+/* Reports the statistics of idle UDP connection on next tick after it
+   receives again. */
 
-  if (e_want_ip6) {
-    port = ntohs(remote->sin6.sin6_port);
-    inet_ntop(AF_INET6, &remote->sin6.sin6_addr, ip, sizeof(ip));
-  } else {
-    port = ntohs(remote->sin.sin_port);
-    inet_ntop(AF_INET, &remote->sin.sin_addr, ip, sizeof(ip));
+static inline void conn_report(struct worker *w, struct socket_conn *conn)
+{
+  if (!e_gstats && conn->timer.expires > w->wheel->now + 1) {
+    timer_del(&conn->timer);
+    timer_add(w->wheel, &conn->timer, w->wheel->now + 1);
   }
+}
+
+static
+struct socket_conn *add_conn(struct worker *w, int sock, c_sockaddr *remote,
+			     struct socket *s_sock)
+{
+  struct sockets *s = w->s;
+  struct socket_conn *conn = NULL;
+  struct epoll_event event;
+  int j;
 
 #ifdef IP_TOS
   if (e_tos) {
@@ -2894,82 +6036,74 @@ struct socket_conn *add_conn(struct sockets *s, int sock, c_sockaddr *remote,
     set_sockopt(sock, IPPROTO_IP, IP_TTL, e_ttl);
 
   if (e_proto == SOCK_STREAM) {
-    if (!e_quiet && e_threads == 1 && !e_csv)
+    if (!e_quiet && !e_csv)
       fprintf(e_output, "[%4x] Accepting TCP connection from %s:%d\n",
-	      sock, ip, port);
+	      sock, addr_ip(remote), addr_port(remote));
 
     /* TCP connection */
-    for (j = 0; j < s->num_sockets; j++) {
-      if (s->sockets[j].sock)
-	continue;
-      conn = calloc(1, sizeof(*conn));
+    j = sockets_get_slot(s);
+    if (j < 0) {
+      SYSLOG((LOG_ERR, "Maximum number of connections reached"));
+      close(sock);
+      return NULL;
+    } else {
+      conn = conn_alloc(w);
       if (!conn) {
 	SYSLOG((LOG_ERR, "Out of memory"));
+	sockets_put_slot(s, j);
 	close(sock);
 	return NULL;
       }
       s->sockets[j].sock = sock;
       s->sockets[j].type = CLIENT;
       s->sockets[j].conn = conn;
-      break;
-    }
 
-    if (j == s->num_sockets) {
-      SYSLOG((LOG_ERR, "Maximum number of connections reached"));
-      close(sock);
-      return NULL;
-    } else {
       memset(&event, 0, sizeof(event));
       event.events |= (EPOLLIN | EPOLLPRI);
       event.data.ptr = &s->sockets[j];
 
-      if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &event)) {
+      if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sock, &event)) {
 	SYSLOG((LOG_INFO, "epoll_ctl: %s\n", strerror(errno)));
 	exit(1);
       }
     }
 
   } else {
-    /* UDP connection */
-    if (!s_sock->conns) {
-      s_sock->conns = calloc(CONN_HASH_SIZE, sizeof(*s_sock->conns));
-      if (!s_sock->conns) {
-	SYSLOG((LOG_ERR, "Out of memory"));
-	close(sock);
-	return NULL;
-      }
-    }
-
-    if (--e_num_conn == 0) {
+    /* UDP connection.  The server socket stays open if the connection
+       cannot be added. */
+    if (__sync_sub_and_fetch(&e_num_conn, 1) < 0) {
+      __sync_add_and_fetch(&e_num_conn, 1);
       SYSLOG((LOG_ERR, "Maximum number of connections reached"));
-      close(sock);
       return NULL;
     }
 
-    conn = calloc(1, sizeof(*conn));
-    if (!conn) {
+    conn = conn_alloc(w);
+    if (conn) {
+      conn->hash = hash_conn(remote);
+      conn->addr = *remote;
+    }
+    if (!conn || put_conn(s_sock, conn) < 0) {
+      __sync_add_and_fetch(&e_num_conn, 1);
       SYSLOG((LOG_ERR, "Out of memory"));
-      close(sock);
+      if (conn)
+	pool_put(&w->conn_pool, conn);
       return NULL;
     }
 
-    hash = hash_conn(remote);
-    conn->next = s_sock->conns[hash];
-    if (conn->next)
-      conn->next->prev = conn;
-    s_sock->conns[hash] = conn;
+    conn->sock = s_sock;
+    conn->start = conn->active = w->wheel->now;
+    timer_add(w->wheel, &conn->timer, e_gstats ?
+	      conn->start + expire_ticks() : conn->start + 1);
 
-    if (!e_quiet && e_threads == 1 && !e_csv)
+    if (!e_quiet && !e_csv)
       fprintf(e_output, "[%lx] Accepting UDP connection from %s:%d\n",
-	      (unsigned long)conn, ip, port);
+	      (unsigned long)conn, addr_ip(remote), addr_port(remote));
   }
 
   conn->addr = *remote;
-  conn->ip = strdup(ip);
-  conn->port = port;
   conn->diag = e_diag;
 
-  g_conns++;
+  w->stats.conns++;
 
   return conn;
 }
@@ -2978,8 +6112,8 @@ struct socket_conn *add_conn(struct sockets *s, int sock, c_sockaddr *remote,
    is returned always when sending pending data. */
 
 static
-int conn_send(unsigned char *buf, struct socket *sock,
-	      struct socket_conn *conn, int fd, int epfd)
+int conn_send(struct worker *w, unsigned char *buf, struct socket *sock,
+	      struct socket_conn *conn, int fd)
 {
   struct epoll_event event;
   int ret = 0, i;
@@ -2988,8 +6122,8 @@ int conn_send(unsigned char *buf, struct socket *sock,
   if (e_unique) {
     unsigned int *p = (unsigned int *)buf;
     for (i = 0; i < conn->buf_len; i += 4) {
-      p[i] ^= (conn->time + e_time + ((char *)p)[i + 1]) ^ ((p[i] + 0x9d2c5681UL) * 1812433253UL) >> 11;
-      e_time++;
+      p[i] ^= (conn->time + w->time + ((char *)p)[i + 1]) ^ ((p[i] + 0x9d2c5681UL) * 1812433253UL) >> 11;
+      w->time++;
     }
   }
 
@@ -3004,7 +6138,7 @@ int conn_send(unsigned char *buf, struct socket *sock,
       conn->buf_len -= ret;
       conn->buf_off += ret;
       conn->send_bytes += ret;
-      g_send_bytes += ret;
+      w->stats.send_bytes += ret;
       if (!conn->buf_len)
 	break;
     }
@@ -3018,17 +6152,18 @@ int conn_send(unsigned char *buf, struct socket *sock,
 	conn->buf_off += ret;
 	conn->send_bytes += ret;
 	conn->send_pkts++;
-	g_send_bytes += ret;
-	g_send_pkts++;
+	w->stats.send_bytes += ret;
+	w->stats.send_pkts++;
       }
     } else {
       /* Send all pending data from all connections */
-      if (!sock->conns)
+      if (!sock->num_conns)
 	return 0;
-      for (i = 0; i < CONN_HASH_SIZE; i ++)
-        for (conn = sock->conns[i]; conn; conn = conn->next)
-	  if (conn->buf_len)
-	    conn_send(conn->buf, sock, conn, fd, epfd);
+      for (i = 0; i < sock->conns_size; i++) {
+	conn = sock->conns[i];
+	if (conn && conn->buf_len)
+	  conn_send(w, conn->buf, sock, conn, fd);
+      }
 
       return 1;
     }
@@ -3038,9 +6173,12 @@ int conn_send(unsigned char *buf, struct socket *sock,
   event.events |= (EPOLLIN | EPOLLPRI);
 
   if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
-    /* Can't write now, do it later */
-    if (!conn->buf) {
-      conn->buf = malloc(65536);
+    /* Can't write now, do it later.  Echoed data is copied to buffer
+       from the pool. */
+    if (buf != conn->buf) {
+      if (conn->buf)
+	buf_put(w->buf_pool, conn->buf);
+      conn->buf = buf_get(w->buf_pool, conn->buf_off + conn->buf_len);
       if (!conn->buf) {
         SYSLOG((LOG_ERR, "%s\n", strerror(errno)));
         exit(1);
@@ -3053,10 +6191,14 @@ int conn_send(unsigned char *buf, struct socket *sock,
   } else if (ret <= 0) {
     /* Error or EOF */
     return -2;
+  } else if (e_server_mode == SERVER_ECHO && conn && conn->buf &&
+	     !conn->buf_len) {
+    /* Pending data sent, give the buffer back */
+    conn_buf_put(w, conn);
   }
 
   event.data.ptr = sock;
-  if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event)) {
+  if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, fd, &event)) {
     SYSLOG((LOG_INFO, "epoll_ctl: %s\n", strerror(errno)));
     exit(1);
   }
@@ -3064,212 +6206,350 @@ int conn_send(unsigned char *buf, struct socket *sock,
   return ret < 0 ? ret : 0;
 }
 
+#define HTTP_NOT_FOUND "HTTP/1.1 404 Not Found\r\n" \
+  "Content-Length: 84\r\n\r\n" \
+  "<body><h1>404 Not Found</h1><p>The page you are looking for cannot be located</body>"
+#define HTTP_BAD_REQUEST "HTTP/1.1 400 Bad Request\r\n" \
+  "Content-Length: 37\r\nConnection: close\r\n\r\n" \
+  "<body><h1>400 Bad Request</h1></body>"
+
+/* Queues HTTP response.  Takes the reference of <file>. */
+
 static
-void conn_http_done(struct socket_conn *conn)
+void conn_http_queue(struct worker *w, struct socket_conn *conn,
+		     struct http_file *file, const char *hdr, size_t hdr_len)
+{
+  struct http_resp *r;
+
+  if (!conn->resp) {
+    conn->resp = (struct http_resp *)
+      buf_get(w->buf_pool, sizeof(*r) * HTTP_PIPELINE);
+    if (!conn->resp) {
+      SYSLOG((LOG_ERR, "%s\n", strerror(errno)));
+      exit(1);
+    }
+  }
+
+  if (e_hexdump) {
+    fprintf(stdout, "\n");
+    hexdump((unsigned char *)hdr, hdr_len, stdout);
+  }
+
+  r = &conn->resp[conn->resp_head + conn->resp_num++];
+  r->file = file;
+  r->hdr = hdr;
+  r->hdr_len = hdr_len;
+}
+
+/* Consumes <len> sent bytes from the queued responses */
+
+static void conn_http_sent(struct socket_conn *conn, size_t len)
 {
-  if (conn->page) {
-    munmap(conn->page, conn->page_size);
-    conn->page = NULL;
+  struct http_resp *r;
+  size_t left;
+
+  while (len) {
+    r = &conn->resp[conn->resp_head];
+    left = r->hdr_len + (r->file ? r->file->size : 0) - conn->resp_off;
+    if (len < left) {
+      conn->resp_off += len;
+      break;
+    }
+    len -= left;
+    conn->resp_off = 0;
+    if (r->file)
+      http_file_put(r->file);
+    conn->resp_head++;
+    conn->resp_num--;
   }
-  conn->buf = conn->bufp;
-  conn->buf_len = 0;
-  conn->buf_off = 0;
-  free(conn->uri);
-  free(conn->method);
-  conn->uri = NULL;
-  conn->method = NULL;
+
+  if (!conn->resp_num)
+    conn->resp_head = 0;
 }
 
+/* Sends the queued HTTP responses.  Headers and mapped file bodies of
+   all queued responses are sent in one write, and larger files straight
+   from the file with sendfile().  If the socket fills up, only EPOLLOUT
+   is polled until the responses are sent, so the send resumes where it
+   stopped.  Returns 0 when all are sent, -1 if some are still pending
+   and -2 on error. */
+
 static
-int conn_http_send(struct socket_conn *conn, struct socket *sock,
-		   int fd, int epfd)
-{
-  int ret, off;
-
-  ret = snprintf((char *)conn->buf, 65536, "%s"
-		"Content-Length: %llu\r\n",
-		HTTP_HEADER,
-		(unsigned long long)conn->page_size);
-  conn->buf_len = strlen((char *)conn->buf);
-  off = ret;
-
-  ret = 0;
-  if (strstr(conn->uri, ".jpg"))
-    ret = snprintf((char *)conn->buf + off, 65536 - off,
-		   "Content-Type: image/jpeg\r\n");
-  else if (strstr(conn->uri, ".gif"))
-    ret = snprintf((char *)conn->buf + off, 65536 - off,
-		   "Content-Type: image/gif\r\n");
-  else if (strstr(conn->uri, ".png"))
-    ret = snprintf((char *)conn->buf + off, 65536 - off,
-		   "Content-Type: image/png\r\n");
-  else if (strstr(conn->uri, ".css"))
-    ret = snprintf((char *)conn->buf + off, 65536 - off,
-		   "Content-Type: text/css\r\n");
-  else if (strstr(conn->uri, ".htm"))
-    ret = snprintf((char *)conn->buf + off, 65536 - off,
-		   "Content-Type: text/html\r\n");
-  else if (strstr(conn->uri, ".php"))
-    ret = snprintf((char *)conn->buf + off, 65536 - off,
-		   "Content-Type: text/html\r\n");
-  else if (strstr(conn->uri, ".txt"))
-    ret = snprintf((char *)conn->buf + off, 65536 - off,
-		   "Content-Type: text/plain\r\n");
-  else if (strstr(conn->uri, ".xml"))
-    ret = snprintf((char *)conn->buf + off, 65536 - off,
-		   "Content-Type: text/xml\r\n");
-  else if (strstr(conn->uri, ".js"))
-    ret = snprintf((char *)conn->buf + off, 65536 - off,
-		   "Content-Type: text/javascript\r\n");
-  if (ret > 0) {
-    conn->buf_len += strlen((char *)conn->buf + off);
-    off += ret;
-  }
+int conn_http_flush(struct worker *w, struct socket_conn *conn,
+		    struct socket *sock, int fd)
+{
+  struct iovec iov[HTTP_PIPELINE * 2];
+  struct epoll_event event;
+  struct http_resp *r;
+  struct msghdr msg;
+  ssize_t ret = 1;
+  size_t skip;
+  off_t off;
+  int i, n, flags;
 
-  if (conn->keepalive) {
-    ret = snprintf((char *)conn->buf + off, 65536 - off,
-		   "Connection: keep-alive\r\n"
-		   "Keep-alive: 60\r\n");
-    conn->buf_len += strlen((char *)conn->buf + off);
-    off += ret;
+  while (conn->resp_num) {
+    r = &conn->resp[conn->resp_head];
+
+    if (r->file && !r->file->data && conn->resp_off >= r->hdr_len) {
+      off = conn->resp_off - r->hdr_len;
+      ret = sendfile(fd, r->file->fd, &off, r->file->size - off);
+    } else {
+      skip = conn->resp_off;
+      flags = MSG_NOSIGNAL;
+      for (i = n = 0; i < conn->resp_num; i++) {
+	r = &conn->resp[conn->resp_head + i];
+	if (skip < r->hdr_len) {
+	  iov[n].iov_base = (char *)r->hdr + skip;
+	  iov[n++].iov_len = r->hdr_len - skip;
+	  skip = 0;
+	} else {
+	  skip -= r->hdr_len;
+	}
+	if (!r->file || !r->file->size)
+	  continue;
+	if (!r->file->data) {
+	  /* Body follows with sendfile() */
+	  flags |= MSG_MORE;
+	  break;
+	}
+	iov[n].iov_base = (char *)r->file->data + skip;
+	iov[n++].iov_len = r->file->size - skip;
+	skip = 0;
+      }
+
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = n;
+      ret = sendmsg(fd, &msg, flags);
+    }
+    if (ret <= 0)
+      break;
+
+    conn->send_bytes += ret;
+    w->stats.send_bytes += ret;
+    conn_http_sent(conn, ret);
   }
 
-  snprintf((char *)conn->buf + off, 65536 - off, "\r\n");
-  conn->buf_len += strlen((char *)conn->buf + off);
-  conn->buf_off = 0;
-  ret = conn_send(conn->buf, sock, conn, fd, epfd);
-  if (ret < 0)
-    return ret;
+  memset(&event, 0, sizeof(event));
+  event.data.ptr = sock;
+
+  if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+    /* Can't write now, continue when the socket is writable */
+    if (!conn->pollout) {
+      event.events = EPOLLOUT;
+      if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, fd, &event)) {
+	SYSLOG((LOG_INFO, "epoll_ctl: %s\n", strerror(errno)));
+	exit(1);
+      }
+      conn->pollout = 1;
+    }
+    return -1;
+  } else if (ret <= 0) {
+    /* Error, or file was truncated while sending */
+    return -2;
+  }
 
-  conn->buf = conn->page;
-  conn->buf_len = conn->page_size;
-  conn->buf_off = 0;
-  ret = conn_send(conn->buf, sock, conn, fd, epfd);
-  if (ret < 0)
-    return ret;
+  if (conn->pollout) {
+    event.events = EPOLLIN | EPOLLPRI;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, fd, &event)) {
+      SYSLOG((LOG_INFO, "epoll_ctl: %s\n", strerror(errno)));
+      exit(1);
+    }
+    conn->pollout = 0;
+  }
 
-  conn_http_done(conn);
   return 0;
 }
 
-static
-int conn_http_send_error(struct socket_conn *conn, struct socket *sock,
-			 int fd, int epfd, char *error, char *body)
+/* Returns pointer to the next CRLF between <p> and <end>, or NULL */
+
+static inline const char *http_crlf(const char *p, const char *end)
 {
-  int ret;
+#ifdef __SSE2__
+  const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+  unsigned int mask;
+
+  /* Compare 16 positions at a time for CR followed by LF */
+  while (end - p > 16) {
+    mask = _mm_movemask_epi8(
+	     _mm_and_si128(
+	       _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), cr),
+	       _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 1)), lf)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif /* __SSE2__ */
 
-  snprintf((char *)conn->buf, 65536, "HTTP/1.1 %s\r\n\r\n%s", error, body);
-  conn->buf_len = strlen((char *)conn->buf);
-  conn->buf_off = 0;
-  ret = conn_send(conn->buf, sock, conn, fd, epfd);
-  if (ret < 0)
-    return ret;
+  for (; end - p > 1; p++)
+    if (p[0] == '\r' && p[1] == '\n')
+      return p;
 
-  conn->buf = conn->bufp;
-  conn->buf_len = 0;
-  conn->buf_off = 0;
-  return 0;
+  return NULL;
 }
 
-/* Parse HTTP data */
+/* HTTP request, the spans point to the receive buffer */
+struct http_req {
+  const char *method;
+  size_t method_len;
+  const char *uri;
+  size_t uri_len;
+  int keepalive;
+};
+
+/* Parses the request line and headers in one pass.  Returns length of
+   the request, 0 if it is not complete yet and -1 if it is malformed. */
 
-static
-int conn_http_parse(char *buf, struct socket *sock,
-		    struct socket_conn *conn, int fd, int epfd)
+static int http_req_parse(struct http_req *req, const char *buf, size_t len)
 {
-  char *tmp;
-  int i;
+  const char *p = buf, *end = buf + len, *eol, *sp, *tok;
 
-  /* Check for end of headers */
-  for (i = 0; i < conn->buf_len ; i++) {
-    if (conn->buf_len - i >= 4 &&
-	buf[i    ] == '\r' && buf[i + 1] == '\n' &&
-	buf[i + 2] == '\r' && buf[i + 3] == '\n')
-      break;
-  }
-  if (i == conn->buf_len)
-    return 1;
+  /* Request line: method, URI and protocol version */
+  eol = http_crlf(p, end);
+  if (!eol)
+    return 0;
 
-  if (!conn->method && !conn->uri) {
-    tmp = memchr(buf, '\n', conn->buf_len);
-    conn->buf_off = tmp - buf;
-    if (!tmp || tmp[-1] != '\r') {
-      if (conn->buf_len < 1024)
-	return 1;
-      return 0;
-    }
-    *tmp = 0;
+  sp = memchr(p, ' ', eol - p);
+  if (!sp)
+    return -1;
+  req->method = p;
+  req->method_len = sp - p;
 
-    /* Get method */
-    if (strchr(buf, ' '))
-      *strchr(buf, ' ') = 0;
-    conn->method = strdup(buf);
+  p = sp + 1;
+  sp = memchr(p, ' ', eol - p);
+  if (!sp)
+    return -1;
+  req->uri = p;
+  req->uri_len = sp - p;
 
-    /* Get URI */
-    tmp = memchr(buf, '\0', conn->buf_len);
-    conn->buf_off = tmp - buf;
-    if (!tmp) {
-      if (conn->buf_len < 1024)
-	return 1;
+  p = sp + 1;
+  if (eol - p != 8 || memcmp(p, "HTTP/1.", 7) || !isdigit(p[7]))
+    return -1;
+  req->keepalive = p[7] != '0';
+
+  /* Headers until empty line, only Connection is of interest */
+  for (;;) {
+    p = eol + 2;
+    eol = http_crlf(p, end);
+    if (!eol)
       return 0;
-    }
-    tmp++;
-    if (strchr(tmp, ' '))
-      *strchr(tmp, ' ') = 0;
-    conn->uri = strdup(tmp);
+    if (eol == p)
+      return eol + 2 - buf;
+
+    if (eol - p < 11 || strncasecmp(p, "Connection:", 11))
+      continue;
 
-    /* Protocol version compatibility */
-    tmp = memchr((unsigned char *)tmp, '\0', conn->buf_len - (tmp - buf)) + 1;
-    conn->buf_off = tmp - buf;
-    conn->keepalive = 0;
-    if (strstr(tmp, "HTTP/1.1"))
-      conn->keepalive = 1;
-    else if (strstr(tmp, "HTTP/1.2"))
-      conn->keepalive = 1;
+    for (p += 11; p < eol; p = tok + 1) {
+      while (p < eol && (*p == ' ' || *p == '\t'))
+	p++;
+      if (p == eol)
+	break;
+      tok = memchr(p, ',', eol - p);
+      if (!tok)
+	tok = eol;
+      sp = tok;
+      while (sp > p && (sp[-1] == ' ' || sp[-1] == '\t'))
+	sp--;
+      if (sp - p == 5 && !strncasecmp(p, "close", 5))
+	req->keepalive = 0;
+      else if (sp - p == 10 && !strncasecmp(p, "keep-alive", 10))
+	req->keepalive = 1;
+    }
   }
+}
+
+/* Parses all complete requests in the buffer, at most HTTP_PIPELINE at
+   a time, and queues their responses.  The rest is left to the
+   beginning of the buffer. */
+
+static
+void conn_http_parse(struct worker *w, struct socket_conn *conn, int fd)
+{
+  char *buf = (char *)conn->buf, filename[1024];
+  struct http_file *file;
+  struct http_req req;
+  size_t off = 0, uri_len;
+  int ret;
 
-  if (conn->method && conn->uri && !strcasecmp(conn->method, "GET")) {
-    /* Cold cuts... */
-    char filename[1024];
-    struct stat st;
-    int get_fd;
+  while (conn->resp_num < HTTP_PIPELINE && !conn->http_close) {
+    ret = http_req_parse(&req, buf + off, conn->buf_len - off);
+    if (!ret && (off || conn->buf_len < 65535))
+      break;
 
-    if (!strcmp(conn->uri, "/"))
+    if (ret <= 0 || req.method_len != 3 ||
+	strncasecmp(req.method, "GET", 3)) {
+      /* Malformed, or headers don't fit to buffer */
+      conn_http_queue(w, conn, NULL, HTTP_BAD_REQUEST,
+		      sizeof(HTTP_BAD_REQUEST) - 1);
+      conn->http_close = 1;
+      break;
+    }
+    off += ret;
+    if (!req.keepalive)
+      conn->http_close = 1;
+
+    /* Cold cuts... query string is ignored */
+    uri_len = req.uri_len;
+    if (memchr(req.uri, '?', uri_len))
+      uri_len = (const char *)memchr(req.uri, '?', uri_len) - req.uri;
+    if (uri_len == 1 && req.uri[0] == '/')
       snprintf(filename, sizeof(filename), "%s/index.html", e_htdocs);
     else
-      snprintf(filename, sizeof(filename), "%s%s", e_htdocs, conn->uri);
-
-    if (strchr(filename, '?'))
-      *strchr(filename, '?') = ' ';
-    while (strchr(filename, '&'))
-      *strchr(filename, '&') = ' ';
+      snprintf(filename, sizeof(filename), "%s%.*s", e_htdocs,
+	       (int)uri_len, req.uri);
 
-    if (!e_quiet && e_threads == 1)
+    if (!e_quiet)
       fprintf(e_output, "[%4x] HTTP GET %s\n", fd, filename);
 
-    if (!lstat(filename, &st)) {
-      conn->page_size = st.st_size;
-      get_fd = open(filename, O_RDONLY);
-      if (get_fd > 0) {
-        conn->page = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, get_fd, 0);
-        close(get_fd);
-        if (conn->page != MAP_FAILED) {
-	  /* Serve 'em */
-	  conn_http_send(conn, sock, fd, epfd);
-	  return 1;
-	}
-      }
+    file = http_cache_get(&w->http_cache, filename);
+    if (file) {
+      /* Serve 'em */
+      conn_http_queue(w, conn, file, file->hdr[req.keepalive],
+		      file->hdr_len[req.keepalive]);
+    } else {
+      conn_http_queue(w, conn, NULL, HTTP_NOT_FOUND,
+		      sizeof(HTTP_NOT_FOUND) - 1);
     }
+  }
 
-    conn->page = NULL;
-    conn_http_send_error(conn, sock, fd, epfd, "404 Not Found",
-			 "<body><h1>404 Not Found</h1><p>The page you are looking for cannot be located</body>");
-  } else {
-    conn_http_send_error(conn, sock, fd, epfd, "400 Bad Request",
-			 "<body><h1>400 Bad Request</h1><body>");
+  conn->buf_len -= off;
+  memmove(buf, buf + off, conn->buf_len);
+}
+
+/* Serves the requests received so far.  Returns 1 if the connection
+   stays open, 0 if it is to be closed and -1 on error. */
+
+static
+int conn_http_serve(struct worker *w, struct socket *sock,
+		    struct socket_conn *conn, int fd)
+{
+  int ret;
+
+  for (;;) {
+    if (!conn->resp_num && conn->buf)
+      conn_http_parse(w, conn, fd);
+    if (!conn->resp_num)
+      break;
+
+    ret = conn_http_flush(w, conn, sock, fd);
+    if (ret == -1)
+      return 1;
+    if (ret < 0)
+      return -1;
   }
 
-  return 0;
+  if (conn->http_close)
+    return 0;
+
+  /* Idle, give the buffers back until next request */
+  if (conn->resp) {
+    buf_put(w->buf_pool, (unsigned char *)conn->resp);
+    conn->resp = NULL;
+  }
+  if (!conn->buf_len)
+    conn_buf_put(w, conn);
+
+  return 1;
 }
 
 static void conn_diag_check(struct socket_conn *conn, unsigned char *buf, int len)
@@ -3288,89 +6568,338 @@ static void conn_diag_check(struct socket_conn *conn, unsigned char *buf, int le
     conn->diag++;
 }
 
-void thread_server(struct sockets *s, int offset, int num)
+#ifdef __linux__
+static struct recv_batch *recv_batch_alloc(int num)
+{
+  struct recv_batch *b;
+  int i;
+
+  b = calloc(1, sizeof(*b));
+  if (!b)
+    return NULL;
+
+  b->msgs = calloc(num, sizeof(*b->msgs));
+  b->out = calloc(num, sizeof(*b->out));
+  b->iov = calloc(num, sizeof(*b->iov));
+  b->addr = calloc(num, sizeof(*b->addr));
+  b->conns = calloc(num, sizeof(*b->conns));
+  b->gso = calloc(num, sizeof(*b->gso));
+  b->ctrl = calloc(num * 2, RECV_CTRL_LEN);
+  b->buf = malloc(num * 65536);
+  if (!b->msgs || !b->out || !b->iov || !b->addr || !b->conns || !b->gso ||
+      !b->ctrl || !b->buf) {
+    free(b->msgs);
+    free(b->out);
+    free(b->iov);
+    free(b->addr);
+    free(b->conns);
+    free(b->gso);
+    free(b->ctrl);
+    free(b->buf);
+    free(b);
+    return NULL;
+  }
+  b->num = num;
+
+  for (i = 0; i < num; i++) {
+    b->iov[i].iov_base = b->buf + (i * 65536);
+    b->iov[i].iov_len = 65536;
+    b->msgs[i].msg_hdr.msg_name = &b->addr[i].sa;
+    b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+    b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+    if (e_gso) {
+      b->msgs[i].msg_hdr.msg_control = b->ctrl + (i * RECV_CTRL_LEN);
+      b->msgs[i].msg_hdr.msg_controllen = RECV_CTRL_LEN;
+    }
+  }
+
+  return b;
+}
+
+/* Returns the UDP GRO segment size of received datagram, or 0 if the
+   datagram was not coalesced. */
+
+static unsigned int recv_gso_size(struct msghdr *msg)
+{
+#ifdef UDP_GRO
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+      return *(int *)CMSG_DATA(cmsg);
+#endif /* UDP_GRO */
+
+  return 0;
+}
+
+/* Returns the number of wire packets in received datagram */
+
+static inline unsigned int recv_gso_pkts(unsigned int len, unsigned int gso)
+{
+  return gso && len > gso ? (len + gso - 1) / gso : 1;
+}
+
+/* Echoes the <num> received datagrams back to their senders with one
+   sendmmsg() call.  Datagrams that cannot be sent now are left pending
+   in their connection, like with conn_send(). */
+
+static void server_echo_batch(struct worker *w, struct socket *sock, int fd,
+			      int num)
+{
+  struct recv_batch *b = w->rbatch;
+  struct socket_conn *conn = NULL;
+  unsigned long long pkts = 0;
+  double bytes = 0;
+  int i, n, ret, sent;
+
+  for (i = 0, n = 0; i < num; i++) {
+    if (!b->conns[i])
+      continue;
+    memset(&b->out[n], 0, sizeof(b->out[n]));
+    b->out[n].msg_hdr.msg_name = &b->conns[i]->addr.sa;
+    b->out[n].msg_hdr.msg_namelen = SIZEOF_SOCKADDR(b->conns[i]->addr);
+    b->out[n].msg_hdr.msg_iov = &b->iov[i];
+    b->out[n].msg_hdr.msg_iovlen = 1;
+    b->iov[i].iov_len = b->msgs[i].msg_len;
+    b->conns[n] = b->conns[i];
+    b->gso[n] = b->gso[i];
+
+#ifdef UDP_SEGMENT
+    /* Coalesced datagrams are segmented back to the received packets */
+    if (recv_gso_pkts(b->iov[i].iov_len, b->gso[n]) > 1) {
+      struct msghdr *msg = &b->out[n].msg_hdr;
+      struct cmsghdr *cmsg;
+
+      msg->msg_control = b->ctrl + ((num + n) * RECV_CTRL_LEN);
+      msg->msg_controllen = CMSG_SPACE(sizeof(unsigned short));
+      cmsg = CMSG_FIRSTHDR(msg);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned short));
+      *(unsigned short *)CMSG_DATA(cmsg) = b->gso[n];
+    }
+#endif /* UDP_SEGMENT */
+    n++;
+  }
+
+  for (sent = 0; sent < n; sent += ret) {
+    ret = sendmmsg(fd, b->out + sent, n - sent, 0);
+    if (ret <= 0)
+      break;
+  }
+
+  /* Statistics, once per flow in the batch */
+  for (i = 0; i < sent; i++) {
+    if (conn != b->conns[i]) {
+      if (conn) {
+	conn->send_bytes += bytes;
+	conn->send_pkts += pkts;
+      }
+      conn = b->conns[i];
+      bytes = pkts = 0;
+    }
+    bytes += b->out[i].msg_len;
+    pkts += recv_gso_pkts(b->out[i].msg_len, b->gso[i]);
+    w->stats.send_bytes += b->out[i].msg_len;
+    w->stats.send_pkts += recv_gso_pkts(b->out[i].msg_len, b->gso[i]);
+  }
+  if (conn) {
+    conn->send_bytes += bytes;
+    conn->send_pkts += pkts;
+  }
+
+  /* Rest are sent when the socket becomes writable.  Coalesced datagrams
+     cannot be left pending as one datagram, they are dropped. */
+  for (i = sent; i < n; i++) {
+    if (recv_gso_pkts(b->out[i].msg_hdr.msg_iov->iov_len, b->gso[i]) > 1)
+      continue;
+    conn = b->conns[i];
+    conn->buf_off = 0;
+    conn->buf_len = b->out[i].msg_hdr.msg_iov->iov_len;
+    if (conn_send(w, b->out[i].msg_hdr.msg_iov->iov_base, sock, conn,
+		  fd) < 0)
+      break;
+  }
+
+  for (i = 0; i < num; i++)
+    b->iov[i].iov_len = 65536;
+}
+
+/* Receives datagrams from UDP server socket with recvmmsg(), and with echo
+   server echoes them back.  Returns < 0 when there is no more data. */
+
+static int server_recv_batch(struct worker *w, struct socket *sock, int fd)
+{
+  struct recv_batch *b = w->rbatch;
+  struct socket_conn *conn;
+  unsigned long long pkts, total_pkts;
+  double bytes, total_bytes;
+  unsigned int len, gso, off;
+  int i, ret;
+
+  while ((ret = recvmmsg(fd, b->msgs, b->num, 0, NULL)) > 0) {
+    conn = NULL;
+    bytes = total_bytes = 0;
+    pkts = total_pkts = 0;
+
+    for (i = 0; i < ret; i++) {
+      len = b->msgs[i].msg_len;
+      gso = b->gso[i] = e_gso ? recv_gso_size(&b->msgs[i].msg_hdr) : 0;
+
+      /* Find the connection, consecutive datagrams are usually from the
+	 same flow */
+      if (!conn || cmp_conn(&conn->addr, &b->addr[i])) {
+	if (conn) {
+	  conn->recv_bytes += bytes;
+	  conn->recv_pkts += pkts;
+	}
+	bytes = pkts = 0;
+
+	conn = find_conn(w->s, &b->addr[i], sock);
+	if (!conn)
+	  /* New connection */
+	  conn = add_conn(w, fd, &b->addr[i], sock);
+	else
+	  conn_report(w, conn);
+      }
+
+      b->conns[i] = conn;
+      if (!conn)
+	continue;
+
+      /* With UDP GRO one datagram may be many packets */
+      bytes += len;
+      pkts += recv_gso_pkts(len, gso);
+      total_bytes += len;
+      total_pkts += recv_gso_pkts(len, gso);
+      if (e_diag) {
+	for (off = 0; gso && len - off > gso; off += gso)
+	  conn_diag_check(conn, b->iov[i].iov_base + off, gso);
+	conn_diag_check(conn, b->iov[i].iov_base + off, len - off);
+      }
+    }
+    if (conn) {
+      conn->recv_bytes += bytes;
+      conn->recv_pkts += pkts;
+    }
+    w->stats.recv_bytes += total_bytes;
+    w->stats.recv_pkts += total_pkts;
+
+    if (e_server_mode == SERVER_ECHO)
+      server_echo_batch(w, sock, fd, ret);
+
+    for (i = 0; i < ret; i++) {
+      memset(&b->addr[i], 0, sizeof(b->addr[i]));
+      b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+      if (e_gso)
+	b->msgs[i].msg_hdr.msg_controllen = RECV_CTRL_LEN;
+    }
+
+    if (ret < b->num)
+      break;
+  }
+
+  return -1;
+}
+#endif /* __linux__ */
+
+void *thread_server(void *context)
 {
+  struct worker *w = context;
+  struct sockets *s = w->s;
   struct epoll_event *fds, event;
   struct socket *sock;
   struct socket_conn *conn;
-  unsigned char buf[65536], *b;
-  int i, j, ret, fd, revents, num_fds, epfd;
-  unsigned long long to, last_active;
+  unsigned char buf[65536];
+  int i, j, ret, fd, revents, num_fds;
+  unsigned long long to;
   unsigned int flen;
   long len;
   c_sockaddr remote;
 
-  signal(SIGPIPE, SIG_IGN);
-
-  num = num + offset > s->num_sockets ? s->num_sockets : num + offset;
-
-  epfd = epoll_create(num * 1);
-  if (epfd < 0) {
+  w->epfd = epoll_create(w->num + 1);
+  if (w->epfd < 0) {
     SYSLOG((LOG_INFO, "Could not create epoll instance\n"));
     exit(1);
   }
 
-  if (!e_quiet && e_threads == 1)
-    fprintf(stderr,
-"------------------------------------------------------------------------------\n");
-
   /* log the connections */
-  sprintf((char *)buf, "PID %d listens %d sockets", getpid(), num);
-  SYSLOG((LOG_INFO, "%s\n", buf));
+  SYSLOG((LOG_INFO, "Thread %d listens %d sockets\n", w->id, w->num));
 
-  num_fds = num + 1;
+  num_fds = w->num + 1;
   fds = calloc(num_fds, sizeof(*fds));
   if (!fds) {
     SYSLOG((LOG_ERR, "%s\n", strerror(errno)));
     exit(1);
   }
 
+  pool_init(&w->conn_pool, sizeof(struct socket_conn), 64, 0);
+  for (i = 0; i < BUF_CLASSES; i++)
+    pool_init(&w->buf_pool[i], BUF_HEADER + buf_class_size[i], 1, 64);
+
+  if (e_proto == SOCK_DGRAM) {
+    w->wheel = timer_wheel_alloc();
+    if (!w->wheel) {
+      SYSLOG((LOG_ERR, "%s\n", strerror(errno)));
+      exit(1);
+    }
+  }
+
+#ifdef __linux__
+  /* UDP datagrams are received in batches.  Unique data and hexdump
+     are done per datagram in conn_send(). */
+  if (e_proto == SOCK_DGRAM && e_batch != 1 && !e_unique && !e_hexdump) {
+    w->rbatch = recv_batch_alloc(e_batch > 1 ? e_batch : RECV_BATCH);
+    if (!w->rbatch) {
+      SYSLOG((LOG_ERR, "%s\n", strerror(errno)));
+      exit(1);
+    }
+  }
+#endif /* __linux__ */
+
   /* Schedule server sockets */
-  for (i = 0, j = offset; i < num; i++, j++) {
+  for (j = w->offset; j < w->offset + w->num; j++) {
     if (!s->sockets[j].sock)
       continue;
     memset(&event, 0, sizeof(event));
     event.events |= (EPOLLIN | EPOLLPRI);
     event.data.ptr = &s->sockets[j];
 
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->sockets[j].sock, &event)) {
-      SYSLOG((LOG_INFO, "epoll_ctl: %s, sock %d %d %d %d %d\n",
-	     strerror(errno), s->sockets[j].sock, j, num, offset, i));
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->sockets[j].sock, &event)) {
+      SYSLOG((LOG_INFO, "epoll_ctl: %s, sock %d %d %d %d\n",
+	     strerror(errno), s->sockets[j].sock, j, w->num, w->offset));
       exit(1);
     }
 
     s->sockets[j].type = SERVER;
   }
 
-  to = rdtsc();
-  last_active = rdtsc();
+  to = ticks();
+  w->last_active = ticks();
 
  loop:
 
-  ret = epoll_wait(epfd, fds, num_fds, e_sleep);
+  ret = epoll_wait(w->epfd, fds, num_fds, e_sleep);
   if (ret < 0) {
-    SYSLOG((LOG_INFO, "PID %d stops listenning: %s", getpid(),
+    SYSLOG((LOG_INFO, "Thread %d stops listenning: %s", w->id,
 	    strerror(errno)));
     exit(1);
   }
 
-  if (e_threads == 1 && (ret == 0 || (rdtsc() - to) / e_freq >= e_sleep)) {
-    print_gstats(1);
-
+  if (ret == 0 || (ticks() - to) / e_freq >= e_sleep) {
     /* Timeout */
-    for (i = 0; i < num_fds; i++) {
-      sock = fds[i].data.ptr;
-      if (!sock || !sock->sock || (sock->type != CLIENT &&
-				   e_proto == SOCK_STREAM))
-	continue;
-      check_conn(sock);
-    }
-    if (e_exit_limit &&
-	(rdtsc() - last_active) / e_freq >= e_exit_limit * 1000) {
-      SYSLOG((LOG_INFO, "PID %d exiting, idle limit reached", getpid()));
-      exit(1);
+    if (e_proto == SOCK_DGRAM) {
+      expire_conns(w);
+    } else {
+      for (i = 0; i < num_fds; i++) {
+	sock = fds[i].data.ptr;
+	if (!sock || !sock->sock || sock->type != CLIENT)
+	  continue;
+	check_conn(w, sock);
+      }
     }
-    to = rdtsc();
+    to = ticks();
   }
 
   for (i = 0; i < ret; i++) {
@@ -3378,7 +6907,7 @@ void thread_server(struct sockets *s, int offset, int num)
     fd = sock->sock;
     revents = fds[i].events;
 
-    last_active = rdtsc();
+    w->last_active = ticks();
 
     if (sock->type == CLIENT) {
       /* Client socket, it's always TCP */
@@ -3390,7 +6919,7 @@ void thread_server(struct sockets *s, int offset, int num)
 	/* Discard server.  We read everything and discard it. */
 	while ((len = read(fd, buf, sizeof(buf))) > 0) {
 	  conn->recv_bytes += len;
-	  g_recv_bytes += len;
+	  w->stats.recv_bytes += len;
 	  conn_diag_check(conn, buf, len);
         }
 
@@ -3401,7 +6930,7 @@ void thread_server(struct sockets *s, int offset, int num)
 
 	if (revents & (EPOLLOUT)) {
 	  /* Echo pending */
-	  len = conn_send(conn->buf, sock, conn, fd, epfd);
+	  len = conn_send(w, conn->buf, sock, conn, fd);
 	  if (len < 0)
 	    break;
 	  continue;
@@ -3410,25 +6939,22 @@ void thread_server(struct sockets *s, int offset, int num)
 	if (revents & (EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP)) {
 	  /* Echo pending */
 	  if (conn->buf && conn->buf_len > 0) {
-	    len = conn_send(conn->buf, sock, conn, fd, epfd);
+	    len = conn_send(w, conn->buf, sock, conn, fd);
 	    if (len < 0)
 	      break;
 	  }
 
-	  b = conn->buf ? conn->buf : buf;
-	  while ((len = read(fd, b, sizeof(buf))) > 0) {
+	  while ((len = read(fd, buf, sizeof(buf))) > 0) {
 	    conn->recv_bytes += len;
-	    g_recv_bytes += len;
+	    w->stats.recv_bytes += len;
 
 	    conn_diag_check(conn, buf, len);
 
-	    /* Echo it back */
+	    /* Echo it back, read more only after it is sent */
 	    conn->buf_off = 0;
 	    conn->buf_len = len;
-	    if ((flen = conn_send(b, sock, conn, fd, epfd)) < 0) {
-	      len = flen;
+	    if ((len = conn_send(w, buf, sock, conn, fd)) < 0)
 	      break;
-	    }
 	  }
 	}
 
@@ -3437,29 +6963,10 @@ void thread_server(struct sockets *s, int offset, int num)
       case SERVER_HTTP:
 	/* HTTP server, serve some directory of web pages */
 
-	if (revents & (EPOLLOUT)) {
-	  /* Send pending */
-	  len = conn_send(conn->buf, sock, conn, fd, epfd);
-	  if (len < 0)
-	    break;
-	  conn_http_done(conn);
-	  len = 0;
-	  if (!conn->keepalive)
-	    break;
-	  continue;
-	}
-
-	if (revents & (EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP)) {
-	  /* Send pending */
-	  if (conn->page && conn->buf_len > 0) {
-	    len = conn_send(conn->buf, sock, conn, fd, epfd);
-	    if (len < 0)
-	      break;
-	    conn_http_done(conn);
-	  }
-
+	if (!(revents & EPOLLOUT) &&
+	    (revents & (EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP))) {
 	  if (!conn->buf) {
-	    conn->buf = conn->bufp = malloc(65536);
+	    conn->buf = conn->bufp = buf_get(w->buf_pool, 65536);
 	    conn->buf_len = 0;
 	    if (!conn->buf) {
 	      SYSLOG((LOG_ERR, "%s\n", strerror(errno)));
@@ -3467,31 +6974,24 @@ void thread_server(struct sockets *s, int offset, int num)
 	    }
 	  }
 
-	  len = read(fd, conn->buf + conn->buf_off, 65535 - conn->buf_off);
-	  if (len > 0) {
-	    conn->recv_bytes += len;
-	    g_recv_bytes += len;
-
-	    if (conn->buf_len == 0)
-	      conn->buf_off = 0;
-	    conn->buf_len += len;
-	    conn->buf[conn->buf_len] = '\0';
-
-	    if (e_hexdump) {
-	      fprintf(stdout, "\n");
-	      hexdump(conn->buf, conn->buf_len, stdout);
-	    }
+	  len = read(fd, conn->buf + conn->buf_len, 65535 - conn->buf_len);
+	  if (len <= 0)
+	    break;
+	  conn->recv_bytes += len;
+	  w->stats.recv_bytes += len;
 
-	    if (conn_http_parse((char *)conn->buf, sock, conn, fd, epfd)) {
-	      len = 0;
-	      if (conn->page == NULL && !conn->keepalive)
-		break;
-	      continue;
-	    }
-	    len = -1;
+	  if (e_hexdump) {
+	    fprintf(stdout, "\n");
+	    hexdump(conn->buf + conn->buf_len, len, stdout);
 	  }
+	  conn->buf_len += len;
 	}
 
+	/* Send pending responses, then serve the requests received */
+	len = conn_http_serve(w, sock, conn, fd);
+	if (len > 0)
+	  continue;
+
 	break;
       }
 
@@ -3499,7 +6999,7 @@ void thread_server(struct sockets *s, int offset, int num)
 	continue;
 
       /* EOF/error, close */
-      close_conn(sock, conn, epfd, len);
+      close_conn(w, sock, conn, len);
       continue;
 
     } else if (sock->type == SERVER) {
@@ -3525,7 +7025,7 @@ void thread_server(struct sockets *s, int offset, int num)
 	  continue;
 	}
 
-	add_conn(s, fd, &remote, epfd, NULL);
+	add_conn(w, fd, &remote, NULL);
 	continue;
       }
 
@@ -3533,6 +7033,12 @@ void thread_server(struct sockets *s, int offset, int num)
       case SERVER_DISCARD:
 	/* Discard server.  We read everything and discard it.  This is
 	   always UDP as we are a server socket. */
+#ifdef __linux__
+	if (w->rbatch) {
+	  server_recv_batch(w, sock, fd);
+	  break;
+	}
+#endif /* __linux__ */
 	flen = SIZEOF_SOCKADDR(remote);
 	memset(&remote, 0, sizeof(remote));
 	while ((len = recvfrom(fd, buf, sizeof(buf), 0, &remote.sa,
@@ -3541,14 +7047,15 @@ void thread_server(struct sockets *s, int offset, int num)
 	  conn = find_conn(s, &remote, sock);
 	  if (!conn) {
 	    /* New connection */
-	    conn = add_conn(s, fd, &remote, epfd, sock);
+	    conn = add_conn(w, fd, &remote, sock);
 	    if (!conn)
 	      continue;
 	  }
+	  conn_report(w, conn);
 	  conn->recv_bytes += len;
 	  conn->recv_pkts++;
-	  g_recv_bytes += len;
-	  g_recv_pkts++;
+	  w->stats.recv_bytes += len;
+	  w->stats.recv_pkts++;
 	  conn_diag_check(conn, buf, len);
 	}
 
@@ -3560,11 +7067,17 @@ void thread_server(struct sockets *s, int offset, int num)
 
 	if (revents & (EPOLLOUT)) {
 	  /* Echo pending */
-	  if (conn_send(NULL, sock, NULL, fd, epfd) > 0)
+	  if (conn_send(w, NULL, sock, NULL, fd) > 0)
 	    continue;
 	}
 
 	if (revents & (EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP)) {
+#ifdef __linux__
+	  if (w->rbatch) {
+	    server_recv_batch(w, sock, fd);
+	    continue;
+	  }
+#endif /* __linux__ */
 	  flen = SIZEOF_SOCKADDR(remote);
 	  memset(&remote, 0, sizeof(remote));
 	  while ((len = recvfrom(fd, buf, sizeof(buf), 0, &remote.sa,
@@ -3573,24 +7086,23 @@ void thread_server(struct sockets *s, int offset, int num)
 	    conn = find_conn(s, &remote, sock);
 	    if (!conn) {
 	      /* New connection */
-	      conn = add_conn(s, fd, &remote, epfd, sock);
+	      conn = add_conn(w, fd, &remote, sock);
 	      if (!conn)
 	        continue;
 	    }
+	    conn_report(w, conn);
 	    conn->recv_bytes += len;
 	    conn->recv_pkts++;
-	    g_recv_bytes += len;
-	    g_recv_pkts++;
+	    w->stats.recv_bytes += len;
+	    w->stats.recv_pkts++;
 
 	    conn_diag_check(conn, buf, len);
 
 	    /* Echo it back */
 	    conn->buf_off = 0;
 	    conn->buf_len = len;
-	    if ((flen = conn_send(buf, sock, conn, fd, epfd)) < 0) {
-	      len = flen;
+	    if (conn_send(w, buf, sock, conn, fd) < 0)
 	      break;
-	    }
 	  }
 	}
       }
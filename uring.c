@@ -0,0 +1,212 @@
+/*
+
+  uring.c
+
+  Copyright (c) 2026 The conntest authors.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+*/
+/* Minimal io_uring interface on top of the raw system calls, so that
+   no external library is needed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+struct uring {
+  int fd;
+
+  /* Submission queue */
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int sq_entries;
+  unsigned int sq_local_tail;
+  unsigned int sq_pending;
+
+  /* Completion queue */
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+struct uring *uring_create(unsigned int entries)
+{
+  struct io_uring_params p;
+  struct uring *ring;
+  unsigned char *sq, *cq;
+  int i;
+
+  ring = calloc(1, sizeof(*ring));
+  if (!ring)
+    return NULL;
+
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = p.cq_off.cqes +
+    p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring->fd,
+		       IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto err;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      goto err;
+    }
+  }
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cq_ring != ring->sq_ring)
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    goto err;
+  }
+
+  sq = ring->sq_ring;
+  ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+
+  /* Submission queue entries are used in order */
+  for (i = 0; i < p.sq_entries; i++)
+    ring->sq_array[i] = i;
+
+  cq = ring->cq_ring;
+  ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return ring;
+
+ err:
+  close(ring->fd);
+  free(ring);
+  return NULL;
+}
+
+void uring_free(struct uring *ring)
+{
+  if (!ring)
+    return;
+
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  free(ring);
+}
+
+int uring_register_buffers(struct uring *ring, struct iovec *iov, int num)
+{
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+	      iov, num) < 0)
+    return -1;
+
+  return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int head;
+
+  head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_local_tail - head >= ring->sq_entries)
+    return NULL;
+
+  sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_local_tail++;
+  ring->sq_pending++;
+
+  return sqe;
+}
+
+int uring_submit(struct uring *ring, unsigned int wait)
+{
+  unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  int ret, submit = ring->sq_pending;
+
+  if (!submit && !wait)
+    return 0;
+
+  /* Publish the queued entries to the kernel */
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+  do {
+    ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags,
+		  NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0)
+    return -1;
+
+  ring->sq_pending -= ret;
+  return ret;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+  unsigned int head = *ring->cq_head;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
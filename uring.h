@@ -0,0 +1,52 @@
+/*
+
+  uring.h
+
+  Copyright (c) 2026 The conntest authors.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring;
+
+/* Creates io_uring instance with <entries> submission queue entries.
+   Returns NULL on error. */
+struct uring *uring_create(unsigned int entries);
+
+/* Destroys the io_uring instance. */
+void uring_free(struct uring *ring);
+
+/* Registers <num> fixed buffers to the ring.  Returns -1 on error. */
+int uring_register_buffers(struct uring *ring, struct iovec *iov, int num);
+
+/* Returns next free submission queue entry, cleared, or NULL if the
+   submission queue is full.  The entry is submitted on uring_submit. */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/* Submits all queued entries and waits for at least <wait> completions.
+   Returns number of submitted entries or -1 on error. */
+int uring_submit(struct uring *ring, unsigned int wait);
+
+/* Returns next completion queue entry or NULL if there are none.  The
+   entry must be released with uring_cqe_seen. */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+/* Releases the completion queue entry returned by uring_peek_cqe. */
+void uring_cqe_seen(struct uring *ring);
+
+#endif /* URING_H */